@@ -13,6 +13,9 @@
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/backing-dev.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/falloc.h>
 #include "prlfs.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
@@ -112,56 +115,154 @@ static int prlfs_mapping_update(struct file *filp)
 }
 #endif
 
-static int prlfs_check_open_flags(const struct file *filp, const struct prlfs_fd *pfd)
+int prlfs_i_revalidate(struct dentry *dentry);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+#define PRLFS_EOPENSTALE EOPENSTALE
+#else
+#define PRLFS_EOPENSTALE ESTALE
+#endif
+
+/*
+ * Close-to-open consistency: the host file is looked at when it is closed
+ * for the last time and when it is opened again. Cached pages are only
+ * dropped if it changed in between.
+ */
+static void prlfs_cto_save(struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	pi->cto_valid = 0;
+	if (!S_ISREG(inode->i_mode) || inode->i_mapping->nrpages == 0)
+		return;
+	/* our own writes changed the host mtime, else the cache is as good */
+	if (pi->cto_written) {
+		pi->cto_written = 0;
+		dentry->d_time = 0;
+		if (prlfs_i_revalidate(dentry) < 0)
+			return;
+	}
+	pi->cto_mtime = inode->i_mtime.tv_sec;
+	pi->cto_size = i_size_read(inode);
+	pi->cto_valid = 1;
+}
+
+/*
+ * Returns 1 if the cached pages are still good for a new open. fresh is set
+ * if the attributes came from the host with the open.
+ */
+static int prlfs_cto_check(struct dentry *dentry, int fresh)
 {
-	if (pfd->f_flags == O_RDWR)
+	struct inode *inode = dentry->d_inode;
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	if (!pi->cto_valid || inode->i_mapping->nrpages == 0) {
+		if (!fresh)
+			dentry->d_time = 0;
 		return 0;
-	if ((O_ACCMODE & filp->f_flags) == pfd->f_flags)
+	}
+	/* host notifications keep the attributes current */
+	if (!fresh && !PRLFS_SB(inode->i_sb)->notify)
+		dentry->d_time = 0;
+	if (prlfs_i_revalidate(dentry) < 0)
 		return 0;
-	return 1;
+	return inode->i_mtime.tv_sec == pi->cto_mtime &&
+	       i_size_read(inode) == pi->cto_size;
+}
+
+/*
+ * May the idle handle serve a new open? Not if the host file changed since
+ * the handle went idle, or the name leads to another host file now.
+ */
+static int prlfs_idle_check(struct dentry *dentry, struct prlfs_fd *pfd)
+{
+	struct inode *inode = dentry->d_inode;
+
+	/*
+	 * The attributes of a create came with its handle, they are good for
+	 * as long as any cached ones.
+	 */
+	if (!PRLFS_SB(inode->i_sb)->notify && !pfd->created)
+		dentry->d_time = 0;
+	/* -ESTALE for another host file */
+	if (prlfs_i_revalidate(dentry) < 0)
+		return 0;
+	return inode->i_mtime.tv_sec == pfd->idle_mtime &&
+	       i_size_read(inode) == pfd->idle_size;
+}
+
+static int prlfs_inode_opened(struct prlfs_inode_info *pi)
+{
+	return pi->pfd[O_RDONLY].f_counter || pi->pfd[O_WRONLY].f_counter ||
+	       pi->pfd[O_RDWR].f_counter;
 }
 
 static int prlfs_open(struct inode *inode, struct file *filp)
 {
-	char *buf, *p;
+	struct prlfs_path *path;
+	char *p;
 	int buflen, ret = 0;
-	unsigned int open_flags;
+	unsigned int open_flags, acc = prlfs_acc_mode(filp->f_flags);
 	struct super_block *sb = inode->i_sb;
 	struct dentry *dentry = FILE_DENTRY(filp);
 	struct prlfs_file_info pfi;
-	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	struct prlfs_file *pf;
+	struct prlfs_fd *pfd;
+	struct prlfs_attr *attr;
+	int fresh;
 
 	DPRINTK("ENTER\n");
-	if (IS_ERR(pfd)) {
-		ret = PTR_ERR(pfd);
-		goto out_nolock;
-	}
-
-	prlfs_inode_lock(inode);
+	pf = kmem_cache_zalloc(prlfs_file_cachep, GFP_KERNEL);
+	if (pf == NULL)
+		return -ENOMEM;
+	mutex_lock(&pi->open_lock);
 
 	//If we already opened this file, we shouldn't send TG request
-	//to host
-	if (pfd->f_counter) {
-		if (prlfs_check_open_flags(filp, pfd)) {
-			DPRINTK("Access denied. File mode: %o\n", pfd->f_flags);
-			ret = -EACCES;
-		} else
-			pfd->f_counter++;
+	//to host. A read-write handle serves opens of any mode.
+reuse:
+	pfd = &pi->pfd[O_RDWR];
+	if (!prlfs_fd_is_open(pfd))
+		pfd = &pi->pfd[acc];
+	if (prlfs_fd_is_open(pfd)) {
+		fresh = pfd->idle && pfd->created;
+		if (pfd->idle && !prlfs_idle_check(dentry, pfd)) {
+			/* not the host file it was opened for, drop it */
+			prlfs_fd_close(inode, pfd);
+			goto reuse;
+		}
+		if (pfd->idle) {
+			/* closed lately, the host handle is still open */
+			prlfs_fd_stat(1);
+			if (!prlfs_inode_opened(pi) &&
+			    !prlfs_cto_check(dentry, fresh)) {
+				ret = prlfs_mapping_update(filp);
+				if (ret < 0)
+					DPRINTK("prlfs_mapping_update return error %d\n", ret);
+				ret = 0;
+			}
+		}
+		pfd->created = 0;
+		spin_lock(&pi->fd_lock);
+		pfd->idle = 0;
+		pfd->f_counter++;
+		spin_unlock(&pi->fd_lock);
 		goto out;
 	}
 
 	//Get file path
-	buflen = PATH_MAX;
-	buf = kmalloc(buflen, GFP_KERNEL);
-	if (buf == NULL) {
-		ret = -ENOMEM;
+	path = prlfs_path_get(dentry);
+	if (IS_ERR(path)) {
+		ret = PTR_ERR(path);
 		goto out;
 	}
-	memset(buf, 0, buflen);
-	p = prlfs_get_path(dentry, buf, &buflen);
-	if (IS_ERR(p)) {
-		ret = PTR_ERR(p);
-		goto out_free_buf;
+	p = path->buf;
+	buflen = path->len;
+	attr = kmem_cache_alloc(prlfs_attr_cachep, GFP_KERNEL);
+	if (attr == NULL) {
+		ret = -ENOMEM;
+		goto out_put;
 	}
 
 	// Here we set full access to file for first open try.
@@ -175,67 +276,114 @@ retry:
 	DPRINTK("file %s\n", p);
 	DPRINTK("flags %x\n", pfi.flags);
 
-	ret = host_request_open(sb, &pfi, p, buflen);
+	ret = host_request_open_attr(sb, &pfi, p, buflen, attr);
 	if (ret < 0) {
 		if (ret == -EPERM) {
 			// IF we can't open host file with O_RDWR, try to
-			// open it with O_RDONLY
+			// open it with the mode asked for, O_RDONLY first
 			if(open_flags & O_RDWR) {
 				open_flags &= ~O_RDWR;
+				if (acc == O_WRONLY)
+					open_flags |= O_WRONLY;
 				goto retry;
 			// If we can't open host file with O_RDONLY and
 			// O_RDWR, try to do it with O_WRONLY
-			} else if (!(open_flags & (O_RDWR|O_WRONLY))) {
+			} else if (acc == O_RDWR &&
+				   !(open_flags & (O_RDWR|O_WRONLY))) {
 				open_flags |= O_WRONLY;
 				goto retry;
 			}
 		}
 		DPRINTK("host_request_open return error %d\n", ret);
-		goto out_free_buf;
+		goto out_attr;
+	}
+	prlfs_fd_stat(0);
+	/* saves the getattr round trip of the close-to-open check */
+	fresh = 0;
+	if (attr->valid) {
+		ret = prlfs_i_update(dentry, attr);
+		if (ret == -ESTALE) {
+			/* another host file now, the VFS looks the name up again */
+			host_request_release(sb, &pfi);
+			dentry->d_time = 0;
+			ret = -PRLFS_EOPENSTALE;
+			goto out_attr;
+		}
+		fresh = ret == 0;
+		ret = 0;
+	}
+	if (!prlfs_inode_opened(pi) && !prlfs_cto_check(dentry, fresh)) {
+		ret = prlfs_mapping_update(filp);
+		if (ret < 0)
+			DPRINTK("prlfs_mapping_update return error %d\n", ret);
+		ret = 0;
+	}
+	pfd = &pi->pfd[prlfs_acc_mode(open_flags)];
+	if (prlfs_fd_is_open(pfd)) {
+		/* got the same mode as an open handle, e.g. O_RDWR opened
+		 * as O_RDONLY, keep just one of them */
+		host_request_release(sb, &pfi);
+		spin_lock(&pi->fd_lock);
+		pfd->idle = 0;
+		pfd->f_counter++;
+		spin_unlock(&pi->fd_lock);
+		goto out_attr;
 	}
 	pfd->fd = pfi.fd;
 	pfd->sfid = pfi.sfid;
+	pfd->f_flags = prlfs_acc_mode(open_flags);
+	spin_lock(&pi->fd_lock);
 	pfd->f_counter = 1;
-	pfd->f_flags = open_flags & O_ACCMODE;
-	dentry->d_time = 0;
-	ret = prlfs_mapping_update(filp);
-	if (ret < 0)
-		DPRINTK("prlfs_mapping_update return error %d\n", ret);
-out_free_buf:
-	kfree(buf);
+	spin_unlock(&pi->fd_lock);
+out_attr:
+	kmem_cache_free(prlfs_attr_cachep, attr);
+out_put:
+	prlfs_path_put(path);
 out:
-	prlfs_inode_unlock(inode);
-out_nolock:
+	mutex_unlock(&pi->open_lock);
+	if (ret < 0) {
+		kmem_cache_free(prlfs_file_cachep, pf);
+	} else {
+		pf->pfd = pfd;
+		filp->private_data = pf;
+	}
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
 
+/* the host must have the data before the handle may be closed */
 static int writeback_inode(struct inode *inode)
 {
-	return filemap_fdatawrite(inode->i_mapping);
+	return filemap_write_and_wait(inode->i_mapping);
 }
 
 static int prlfs_release(struct inode *inode, struct file *filp)
 {
-	struct super_block *sb = inode->i_sb;
-	struct prlfs_file_info pfi;
-	struct prlfs_fd *pfd = inode_get_pfd(inode);
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	struct prlfs_file *pf = PRLFS_F(filp);
+	struct prlfs_fd *pfd = pf->pfd;
 	int ret = 0;
 
 	DPRINTK("ENTER\n");
 	writeback_inode(inode);
 
-	prlfs_inode_lock(inode);
+	mutex_lock(&pi->open_lock);
 	BUG_ON(!pfd->f_counter);
-	if (pfd->f_counter == 1) {
-		init_pfi(&pfi, inode, 0, 0);
-		ret = host_request_release(sb, &pfi);
-		if (ret < 0)
-			printk(KERN_ERR "prlfs_release returns error (%d)\n", ret);
-	}
-
-	pfd->f_counter--;
-	prlfs_inode_unlock(inode);
+	spin_lock(&pi->fd_lock);
+	/* writeback may go on using the handle until it is closed */
+	if (--pfd->f_counter == 0)
+		pfd->idle = 1;
+	spin_unlock(&pi->fd_lock);
+	/* keep the host handle for a reopen, unless the file is gone */
+	if (pfd->f_counter == 0 &&
+	    ((*prlfs_dfl(FILE_DENTRY(filp)) & PRL_DFL_UNLINKED) ||
+	     !prlfs_idle_add(inode, pfd)))
+		prlfs_fd_close(inode, pfd);
+	if (!prlfs_inode_opened(pi))
+		prlfs_cto_save(FILE_DENTRY(filp));
+	mutex_unlock(&pi->open_lock);
+	vfree(pf->rdbuf);
+	kmem_cache_free(prlfs_file_cachep, pf);
 	DPRINTK("EXIT returning %d f_counter %llu\n", ret, pfd->f_counter);
 	return ret;
 }
@@ -247,17 +395,32 @@ static unsigned char prlfs_filetype_table[PRLFS_FILE_TYPE_MAX] = {
 	DT_LNK,
 };
 
+/* Inode number for a directory entry the host did not number */
+static ino_t prlfs_dirent_next_ino(struct super_block *sb)
+{
+	unsigned int ino;
+
+	do {
+		ino = atomic_inc_return(&PRLFS_SB(sb)->dirent_next_ino);
+	} while (ino < PRLFS_GOOD_INO);
+	return ino;
+}
+
 static int prlfs_fill_dir(struct file *filp,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 					struct dir_context *ctx,
 #else
 					void *dirent, filldir_t filldir,
 #endif
-					loff_t *pos, void *buf, int buflen)
+					loff_t *pos, void *buf, int buflen, int plus)
 {
 	struct super_block *sb;
+	struct dentry *dentry = FILE_DENTRY(filp);
 	prlfs_dirent *de;
-	int offset, ret, name_len, rec_len;
+	prlfs_dirent_plus *dep = NULL;
+	prlfs_dirent_ino *dei = NULL;
+	char *name;
+	int offset, ret, name_len, rec_len, dino;
 	u64 ino;
 	u8 type;
 
@@ -265,19 +428,39 @@ static int prlfs_fill_dir(struct file *filp,
 	assert(FILE_DENTRY(filp));
 	assert(FILE_DENTRY(filp)->d_sb);
 	sb = FILE_DENTRY(filp)->d_sb;
+	dino = !plus && PRLFS_SB(sb)->dirent_ino;
 	offset = 0;
 	ret = 0;
 
 	while (1) {
-		de = (prlfs_dirent *)(buf + offset);
-		if (offset + sizeof(prlfs_dirent) > buflen)
-			goto out;
-
-		name_len = de->name_len;
+		if (plus) {
+			dep = (prlfs_dirent_plus *)(buf + offset);
+			if (offset + sizeof(prlfs_dirent_plus) > buflen)
+				goto out;
+			name_len = dep->name_len;
+			name = dep->name;
+			type = dep->file_type;
+			rec_len = PRLFS_DIRPLUS_REC_LEN(name_len);
+		} else if (dino) {
+			dei = (prlfs_dirent_ino *)(buf + offset);
+			if (offset + sizeof(prlfs_dirent_ino) > buflen)
+				goto out;
+			name_len = dei->name_len;
+			name = dei->name;
+			type = dei->file_type;
+			rec_len = PRLFS_DIRINO_REC_LEN(name_len);
+		} else {
+			de = (prlfs_dirent *)(buf + offset);
+			if (offset + sizeof(prlfs_dirent) > buflen)
+				goto out;
+			name_len = de->name_len;
+			name = de->name;
+			type = de->file_type;
+			rec_len = PRLFS_DIR_REC_LEN(name_len);
+		}
 		if (name_len == 0)
 			goto out;
 
-		rec_len = PRLFS_DIR_REC_LEN(name_len);
 		if (rec_len + offset > buflen) {
 			printk(PFX "invalid rec_len %d "
 			       "(name_len %d offset %d buflen %d)\n",
@@ -285,14 +468,13 @@ static int prlfs_fill_dir(struct file *filp,
 			ret = -EINVAL;
 			goto out;
 		}
-		if (de->name[name_len] != 0) {
+		if (name[name_len] != 0) {
 			printk(PFX "invalid file name "
 			       "(name_len %d offset %d buflen %d)\n",
 				name_len, offset, buflen);
 			ret = -EINVAL;
 			goto out;
 		}
-		type = de->file_type;
 		if (type >= PRLFS_FILE_TYPE_MAX) {
 			printk(PFX "invalid file type: %x, "
 				"use UNKNOWN type instead "
@@ -300,15 +482,25 @@ static int prlfs_fill_dir(struct file *filp,
 				type, name_len, offset, buflen);
 			type = PRLFS_FILE_TYPE_UNKNOWN;
 		}
-		type = prlfs_filetype_table[type];
-		ino = iunique(sb, PRLFS_GOOD_INO);
 		DPRINTK("filldir: name %s len %d, offset %lld, "
 						"de->type %d -> type %d\n",
-			 de->name, name_len, (*pos), de->file_type, type);
+			 name, name_len, (*pos), type, prlfs_filetype_table[type]);
+		type = prlfs_filetype_table[type];
+		ino = 0;
+		if (plus) {
+			ino = prlfs_dentry_prime(dentry, name, name_len,
+						 &dep->attr);
+			if (ino == 0 && PRLFS_SB(sb)->host_inodes &&
+			    (dep->attr.valid & _PATTR2_INO))
+				ino = dep->attr.ino;
+		} else if (dino)
+			ino = dei->ino;
+		if (ino == 0)
+			ino = prlfs_dirent_next_ino(sb);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
-		if (!dir_emit(ctx, de->name, name_len, ino, type))
+		if (!dir_emit(ctx, name, name_len, ino, type))
 #else
-		if (filldir(dirent, de->name, name_len, (*pos), ino, type) < 0)
+		if (filldir(dirent, name, name_len, (*pos), ino, type) < 0)
 #endif
 			goto out;
 
@@ -332,7 +524,7 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	struct prlfs_file_info pfi;
 	struct super_block *sb;
 	struct inode *inode;
-	int ret, len, buflen;
+	int ret, len, buflen, plus;
 	void *buf;
 	off_t prev_offset;
 
@@ -340,7 +532,7 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	ret = 0;
 	assert(FILE_DENTRY(filp));
 	inode = FILE_DENTRY(filp)->d_inode;
-	init_pfi(&pfi, inode,
+	init_pfi(&pfi, PRLFS_F(filp)->pfd,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 		ctx->pos,
 #else
@@ -349,16 +541,37 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		0);
 	assert(FILE_DENTRY(filp)->d_sb);
 	sb = FILE_DENTRY(filp)->d_sb;
-	buflen = PAGE_SIZE;
-	buf = kmalloc(buflen, GFP_KERNEL);
+	/* kept until release, getdents(2) calls come in a row */
+	buf = PRLFS_F(filp)->rdbuf;
+	buflen = PRLFS_SB(sb)->rdsize;
+	if (PRLFS_F(filp)->rdsize)
+		buflen = PRLFS_F(filp)->rdsize;
 	if (buf == NULL) {
-		ret = -ENOMEM;
-		goto out;
+		buf = vmalloc(buflen);
+		if (buf == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		PRLFS_F(filp)->rdbuf = buf;
 	}
+	plus = PRLFS_SB(sb)->readdirplus;
 	while (pfi.flags == 0) {
 		len = buflen;
 		memset(buf, 0, len);
-		ret = host_request_readdir(sb, &pfi, buf, &len);
+		if (plus)
+			ret = host_request_readdirplus(sb, &pfi, buf, &len);
+		else
+			ret = host_request_readdir(sb, &pfi, buf, &len);
+		if (ret == -EINVAL && buflen > PAGE_SIZE) {
+			/*
+			 * Maybe the host does not take big buffers, stay with
+			 * a page for this directory. The next open tries again,
+			 * -EINVAL stands for other host errors as well.
+			 */
+			DPRINTK("readdir buffer of %d bytes rejected\n", buflen);
+			buflen = PRLFS_F(filp)->rdsize = PAGE_SIZE;
+			continue;
+		}
 		if (ret < 0)
 			break;
 
@@ -369,13 +582,12 @@ static int prlfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 #else
 					dirent, filldir,
 #endif
-					&pfi.offset, buf, len);
+					&pfi.offset, buf, len, plus);
 		if (ret < 0)
 			break;
 		if (pfi.offset == prev_offset)
 			break;
 	}
-	kfree(buf);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
 	ctx->pos = pfi.offset;
 #else
@@ -386,13 +598,18 @@ out:
 	return ret;
 }
 
-ssize_t prlfs_rw(struct inode *inode, char *buf, size_t size,
-			loff_t *off, unsigned int rw, int user, int flags)
+/*
+ * Reads or writes the host file through the handle of filp, or through one
+ * of the inode if there is no file, as on writeback.
+ */
+ssize_t prlfs_rw(struct inode *inode, struct file *filp, char *buf,
+		 size_t size, loff_t *off, unsigned int rw, int user, int flags)
 {
 	ssize_t ret;
 	struct super_block *sb;
 	struct prlfs_file_info pfi;
 	struct buffer_descriptor bd;
+	struct prlfs_fd *pfd;
 
 	DPRINTK("ENTER\n");
 	if (rw >= 2) {
@@ -400,16 +617,27 @@ ssize_t prlfs_rw(struct inode *inode, char *buf, size_t size,
 		BUG();
 	}
 	ret = 0;
-	init_pfi(&pfi, inode, *off, rw);
-
 	if (size == 0)
 		goto out;
 
+	pfd = prlfs_fd_get(inode, filp, rw);
+	if (pfd == NULL) {
+		ret = -EBADF;
+		goto out;
+	}
+	init_pfi(&pfi, pfd, *off, rw);
+	if (rw) {
+		PRLFS_I(inode)->cto_written = 1;
+		atomic_inc(&PRLFS_I(inode)->wr_pending);
+	}
 	sb = inode->i_sb;
 	init_buffer_descriptor(&bd, buf, size,(rw == 0) ? 1 : 0,
 						(user == 0) ? 0 : 1);
 	bd.flags = flags;
 	ret = host_request_rw(sb, &pfi, &bd);
+	if (rw)
+		atomic_dec(&PRLFS_I(inode)->wr_pending);
+	prlfs_fd_put(inode, filp, pfd);
 	if (ret < 0)
 		goto out;
 
@@ -421,13 +649,580 @@ out:
 	return ret;
 }
 
+#ifdef PRLFS_ITER_IO
+/*
+ * Transfer iov_iter data to or from the host bypassing the page cache.
+ * User memory is handed to toolgate as is and gets pinned there, other
+ * kinds of iterators are bounced through a kernel page.
+ */
+ssize_t prlfs_rw_iter(struct inode *inode, struct file *filp,
+		      struct iov_iter *iter, loff_t *off, unsigned int rw)
+{
+	ssize_t ret = 0, done = 0;
+	char *bounce = NULL;
+
+	while (iov_iter_count(iter)) {
+		size_t len;
+
+		if (iter_is_iovec(iter)) {
+			struct iovec iov = iov_iter_iovec(iter);
+
+			len = iov.iov_len;
+			ret = prlfs_rw(inode, filp, iov.iov_base, len, off, rw,
+				       1, TG_REQ_COMMON);
+			if (ret > 0)
+				iov_iter_advance(iter, ret);
+		} else {
+			if (bounce == NULL) {
+				bounce = (char *)__get_free_page(GFP_KERNEL);
+				if (bounce == NULL) {
+					ret = -ENOMEM;
+					break;
+				}
+			}
+			len = min_t(size_t, iov_iter_count(iter), PAGE_SIZE);
+			if (rw) {
+				struct iov_iter tmp = *iter;
+
+				if (copy_from_iter(bounce, len, &tmp) != len) {
+					ret = -EFAULT;
+					break;
+				}
+			}
+			ret = prlfs_rw(inode, filp, bounce, len, off, rw, 0,
+				       TG_REQ_COMMON);
+			if (ret > 0) {
+				if (rw)
+					iov_iter_advance(iter, ret);
+				else if (copy_to_iter(bounce, ret, iter) != ret)
+					ret = -EFAULT;
+			}
+		}
+		if (ret < 0)
+			break;
+		done += ret;
+		if (ret < len)
+			break;
+	}
+	if (bounce)
+		free_page((unsigned long)bounce);
+	return done ? done : ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define prlfs_ki_complete(iocb, res) (iocb)->ki_complete(iocb, res)
+#else
+#define prlfs_ki_complete(iocb, res) (iocb)->ki_complete(iocb, res, 0)
+#endif
+
+/* aio request, sent to the host as one toolgate request per iovec segment */
+struct prlfs_aio {
+	struct kiocb *iocb;
+	atomic_t pending;
+	unsigned int rw;
+	unsigned long nr_segs;
+	struct prlfs_aio_seg {
+		struct prlfs_aio *aio;
+		size_t len;
+		ssize_t ret;
+	} seg[0];
+};
+
+/*
+ * Only plain user iovecs go asynchronous, and writes only inside the
+ * file: i_size is extended by the synchronous path only.
+ */
+int prlfs_aio_possible(struct kiocb *iocb, struct iov_iter *iter,
+		       unsigned int rw)
+{
+	struct inode *inode = FILE_DENTRY(iocb->ki_filp)->d_inode;
+	unsigned long i;
+
+	if (is_sync_kiocb(iocb) || !iter_is_iovec(iter))
+		return 0;
+	/* O_SYNC and O_DSYNC writes wait for the host flush */
+	if (rw && (iocb->ki_flags & IOCB_DSYNC))
+		return 0;
+	if (rw && iocb->ki_pos + iov_iter_count(iter) > i_size_read(inode))
+		return 0;
+	for (i = 0; i < iter->nr_segs; i++)
+		if (iter->iov[i].iov_len == (i ? 0 : iter->iov_offset))
+			return 0;
+	return 1;
+}
+
+static void prlfs_aio_complete(struct prlfs_aio *aio)
+{
+	struct kiocb *iocb = aio->iocb;
+	struct dentry *dentry = FILE_DENTRY(iocb->ki_filp);
+	ssize_t res = 0;
+	unsigned long i;
+
+	/* the result is what was transferred up to the first short segment */
+	for (i = 0; i < aio->nr_segs; i++) {
+		if (aio->seg[i].ret < 0) {
+			if (res == 0)
+				res = aio->seg[i].ret;
+			break;
+		}
+		res += aio->seg[i].ret;
+		if (aio->seg[i].ret < aio->seg[i].len)
+			break;
+	}
+	if (aio->rw)
+		dentry->d_time = 0;
+	if (res > 0)
+		iocb->ki_pos += res;
+	inode_dio_end(dentry->d_inode);
+	kfree(aio);
+	prlfs_ki_complete(iocb, res);
+}
+
+static void prlfs_aio_seg_done(void *data, ssize_t ret)
+{
+	struct prlfs_aio_seg *seg = data;
+	struct prlfs_aio *aio = seg->aio;
+
+	seg->ret = ret;
+	if (atomic_dec_and_test(&aio->pending))
+		prlfs_aio_complete(aio);
+}
+
+/*
+ * Submit all segments of iter to the host and return without waiting,
+ * the iocb is completed from the toolgate completion path.
+ */
+ssize_t prlfs_rw_iter_async(struct kiocb *iocb, struct iov_iter *iter,
+			    unsigned int rw)
+{
+	struct inode *inode = FILE_DENTRY(iocb->ki_filp)->d_inode;
+	struct prlfs_file_info pfi;
+	struct buffer_descriptor bd;
+	struct prlfs_aio *aio;
+	struct prlfs_fd *pfd;
+	loff_t pos = iocb->ki_pos;
+	unsigned long i;
+	int ret;
+
+	/* the file holds the handle until the iocb is completed */
+	pfd = prlfs_fd_get(inode, iocb->ki_filp, rw);
+	if (pfd == NULL)
+		return -EBADF;
+	aio = kmalloc(sizeof(struct prlfs_aio) +
+		      iter->nr_segs * sizeof(struct prlfs_aio_seg), GFP_KERNEL);
+	if (aio == NULL)
+		return -ENOMEM;
+	aio->iocb = iocb;
+	aio->rw = rw;
+	if (rw)
+		PRLFS_I(inode)->cto_written = 1;
+	/* submitter's reference, keeps aio alive until all segments are sent */
+	atomic_set(&aio->pending, 1);
+	inode_dio_begin(inode);
+
+	for (i = 0; i < iter->nr_segs && iov_iter_count(iter); ) {
+		struct iovec iov = iov_iter_iovec(iter);
+		struct prlfs_aio_seg *seg = &aio->seg[i++];
+
+		seg->aio = aio;
+		seg->len = iov.iov_len;
+		seg->ret = 0;
+		init_pfi(&pfi, pfd, pos, rw);
+		init_buffer_descriptor(&bd, iov.iov_base, iov.iov_len,
+				       (rw == 0) ? 1 : 0, 1);
+		atomic_inc(&aio->pending);
+		ret = host_request_rw_async(inode->i_sb, &pfi, &bd,
+					    prlfs_aio_seg_done, seg);
+		if (ret < 0) {
+			atomic_dec(&aio->pending);
+			seg->ret = ret;
+			break;
+		}
+		pos += iov.iov_len;
+		iov_iter_advance(iter, iov.iov_len);
+	}
+	aio->nr_segs = i;
+
+	if (atomic_dec_and_test(&aio->pending))
+		prlfs_aio_complete(aio);
+	return -EIOCBQUEUED;
+}
+
+/* write in flight, see prlfs_range_lock() */
+struct prlfs_range {
+	struct list_head list;
+	loff_t start;
+	loff_t end;
+};
+
+static int prlfs_range_trylock(struct prlfs_inode_info *pi,
+			       struct prlfs_range *r)
+{
+	struct prlfs_range *cur;
+	int ret = 1;
+
+	spin_lock(&pi->wr_lock);
+	list_for_each_entry(cur, &pi->wr_ranges, list)
+		if (cur->start < r->end && r->start < cur->end) {
+			ret = 0;
+			break;
+		}
+	if (ret)
+		list_add(&r->list, &pi->wr_ranges);
+	spin_unlock(&pi->wr_lock);
+	return ret;
+}
+
+/*
+ * Writers holding the inode lock shared exclude only each other's
+ * overlapping ranges, so that one write is never mixed with another.
+ */
+static void prlfs_range_lock(struct inode *inode, struct prlfs_range *r,
+			     loff_t pos, size_t len)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	r->start = pos;
+	r->end = pos + len;
+	wait_event(pi->wr_wait, prlfs_range_trylock(pi, r));
+}
+
+static void prlfs_range_unlock(struct inode *inode, struct prlfs_range *r)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	spin_lock(&pi->wr_lock);
+	list_del(&r->list);
+	spin_unlock(&pi->wr_lock);
+	wake_up_all(&pi->wr_wait);
+}
+
+/* Parallel writers may end past EOF in any order, i_size only grows here */
+void prlfs_i_size_extend(struct inode *inode, loff_t pos)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	spin_lock(&pi->wr_lock);
+	if (i_size_read(inode) < pos)
+		i_size_write(inode, pos);
+	spin_unlock(&pi->wr_lock);
+}
+
+static ssize_t prlfs_write_through(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dentry *dentry = FILE_DENTRY(iocb->ki_filp);
+	struct inode *inode = dentry->d_inode;
+	struct prlfs_range range;
+	/* appends need i_size to stay put until they are done */
+	int shared = !(iocb->ki_flags & IOCB_APPEND);
+	loff_t pos;
+	ssize_t ret;
+
+	if (shared)
+		inode_lock_shared(inode);
+	else
+		prlfs_inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+
+	/*
+	 * aio is not range locked: it completes from the toolgate callback,
+	 * long after we return. As with O_DIRECT aio on other filesystems,
+	 * overlapping writes in flight together land in any order.
+	 */
+	if (prlfs_aio_possible(iocb, from, 1)) {
+		ret = prlfs_rw_iter_async(iocb, from, 1);
+		goto out;
+	}
+	pos = iocb->ki_pos;
+	if (shared)
+		prlfs_range_lock(inode, &range, pos, iov_iter_count(from));
+	ret = prlfs_rw_iter(inode, iocb->ki_filp, from, &pos, 1);
+	if (shared)
+		prlfs_range_unlock(inode, &range);
+	dentry->d_time = 0;
+	if (ret > 0) {
+		iocb->ki_pos = pos;
+		prlfs_i_size_extend(inode, pos);
+	}
+out:
+	if (shared)
+		inode_unlock_shared(inode);
+	else
+		prlfs_inode_unlock(inode);
+	/* O_SYNC and O_DSYNC: ask the host to put the data to its disk */
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static ssize_t prlfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct super_block *sb = FILE_DENTRY(iocb->ki_filp)->d_sb;
+
+	if (PRLFS_SB(sb)->cache == PRLFS_CACHE_NONE)
+		return prlfs_write_through(iocb, from);
+	return generic_file_write_iter(iocb, from);
+}
+
+static ssize_t prlfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct dentry *dentry = FILE_DENTRY(iocb->ki_filp);
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	if (PRLFS_SB(dentry->d_sb)->cache == PRLFS_CACHE_NONE) {
+		if (prlfs_aio_possible(iocb, to, 0))
+			return prlfs_rw_iter_async(iocb, to, 0);
+		ret = prlfs_rw_iter(dentry->d_inode, iocb->ki_filp, to, &pos,
+				    0);
+		if (ret > 0)
+			iocb->ki_pos = pos;
+		return ret;
+	}
+	/* pick up the host file size before looking at the page cache */
+	ret = prlfs_i_revalidate(dentry);
+	/* -ESTALE: the name leads to another file, the handle reads ours */
+	if (ret < 0 && ret != -ESTALE)
+		return ret;
+	return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * Copies or clones a range between two files of the share on the host,
+ * the data does not pass through the guest. The inode of file_out must be
+ * locked. Returns the bytes copied.
+ */
+static ssize_t __prlfs_copy_range(struct file *file_in, loff_t pos_in,
+				  struct file *file_out, loff_t pos_out,
+				  u64 len, unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = dst->i_sb;
+	struct prlfs_file_info pin, pout;
+	struct prlfs_copy_range cr;
+	ssize_t ret;
+
+	/* the host copies its own files, not what is cached here */
+	ret = filemap_write_and_wait_range(src->i_mapping, pos_in,
+					   pos_in + len - 1);
+	if (ret < 0)
+		return ret;
+	ret = filemap_write_and_wait_range(dst->i_mapping, pos_out,
+					   pos_out + len - 1);
+	if (ret < 0)
+		return ret;
+	/* as for write(2): suid and sgid go, mtime and ctime move */
+	ret = file_remove_privs(file_out);
+	if (ret < 0)
+		return ret;
+	file_update_time(file_out);
+
+	init_pfi(&pin, PRLFS_F(file_in)->pfd, pos_in, 0);
+	init_pfi(&pout, PRLFS_F(file_out)->pfd, pos_out, 0);
+	cr.len = len;
+	cr.flags = flags;
+	cr.reserved = 0;
+	PRLFS_I(dst)->cto_written = 1;
+	ret = host_request_copy(sb, &pin, &pout, &cr);
+	FILE_DENTRY(file_out)->d_time = 0;
+	if (ret < 0) {
+		/* let the VFS fall back to copying through the page cache */
+		if (ret == -ENOTSUPP)
+			ret = -EOPNOTSUPP;
+		return ret;
+	}
+	ret = min_t(u64, cr.len, len);
+	if (ret > 0) {
+		invalidate_inode_pages2_range(dst->i_mapping,
+					      pos_out >> PAGE_SHIFT,
+					      (pos_out + ret - 1) >> PAGE_SHIFT);
+		prlfs_i_size_extend(dst, pos_out + ret);
+	}
+	return ret;
+}
+
+static ssize_t prlfs_copy_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				u64 len, unsigned int flags)
+{
+	struct inode *dst = file_inode(file_out);
+	ssize_t ret;
+
+	if (file_inode(file_in)->i_sb != dst->i_sb)
+		return -EXDEV;
+	if (!PRLFS_SB(dst->i_sb)->copy)
+		return -EOPNOTSUPP;
+	if (len == 0)
+		return 0;
+	prlfs_inode_lock(dst);
+	ret = __prlfs_copy_range(file_in, pos_in, file_out, pos_out, len,
+				 flags);
+	prlfs_inode_unlock(dst);
+	return ret;
+}
+
+static ssize_t prlfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     size_t len, unsigned int flags)
+{
+	return prlfs_copy_range(file_in, pos_in, file_out, pos_out, len, 0);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+static loff_t prlfs_remap_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	loff_t ret;
+
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return -EOPNOTSUPP;
+	if (!PRLFS_SB(dst->i_sb)->copy)
+		return -EOPNOTSUPP;
+	lock_two_nondirectories(src, dst);
+	/* checks the ranges, resolves a zero length to the end of the source */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret == 0 && len)
+		ret = __prlfs_copy_range(file_in, pos_in, file_out, pos_out,
+					 len, PRLFS_COPY_CLONE);
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+#else
+static int prlfs_clone_file_range(struct file *file_in, loff_t pos_in,
+				  struct file *file_out, loff_t pos_out, u64 len)
+{
+	ssize_t ret;
+
+	if (len == 0) {
+		if (pos_in >= i_size_read(file_inode(file_in)))
+			return 0;
+		len = i_size_read(file_inode(file_in)) - pos_in;
+	}
+	ret = prlfs_copy_range(file_in, pos_in, file_out, pos_out, len,
+			       PRLFS_COPY_CLONE);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EINVAL;
+}
+#endif
+
+static long prlfs_fallocate(struct file *filp, int mode, loff_t offset,
+			    loff_t len)
+{
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct prlfs_file_info pfi;
+	struct prlfs_fallocate fa;
+	long ret;
+
+	if (!PRLFS_SB(sb)->fallocate)
+		return -EOPNOTSUPP;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	fa.len = len;
+	fa.mode = 0;
+	fa.reserved = 0;
+	if (mode & FALLOC_FL_KEEP_SIZE)
+		fa.mode |= PRLFS_FALLOC_KEEP_SIZE;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		fa.mode |= PRLFS_FALLOC_PUNCH_HOLE;
+	if (mode & FALLOC_FL_ZERO_RANGE)
+		fa.mode |= PRLFS_FALLOC_ZERO_RANGE;
+
+	prlfs_inode_lock(inode);
+	inode_dio_wait(inode);
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset,
+					   offset + len - 1);
+	if (ret < 0)
+		goto out;
+	init_pfi(&pfi, PRLFS_F(filp)->pfd, offset, 1);
+	PRLFS_I(inode)->cto_written = 1;
+	ret = host_request_fallocate(sb, &pfi, &fa);
+	FILE_DENTRY(filp)->d_time = 0;
+	if (ret == -ENOTSUPP)
+		ret = -EOPNOTSUPP;
+	if (ret < 0)
+		goto out;
+	/*
+	 * The range reads as zeroes now, drop pages that reads filled with
+	 * the old data meanwhile.
+	 */
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		truncate_pagecache_range(inode, offset, offset + len - 1);
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+		prlfs_i_size_extend(inode, offset + len);
+out:
+	prlfs_inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * SEEK_DATA and SEEK_HOLE look at the host file, so that sparse files are
+ * copied as such. Without host support the whole file is data.
+ */
+static loff_t prlfs_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(filp);
+	struct prlfs_file_info pfi;
+	struct prlfs_seek ps;
+	int ret;
+
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) ||
+	    !PRLFS_SB(inode->i_sb)->seek)
+		return generic_file_llseek(filp, offset, whence);
+	if (offset < 0)
+		return -ENXIO;
+	/* dirty pages may fill holes of the host file */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret < 0)
+		return ret;
+	ps.offset = offset;
+	ps.whence = whence == SEEK_DATA ? PRLFS_SEEK_DATA : PRLFS_SEEK_HOLE;
+	ps.reserved = 0;
+	init_pfi(&pfi, PRLFS_F(filp)->pfd, offset, 0);
+	ret = host_request_seek(inode->i_sb, &pfi, &ps);
+	if (ret == -ENOTSUPP)
+		return generic_file_llseek(filp, offset, whence);
+	if (ret < 0)
+		return ret;
+	if (ps.offset == PRLFS_SEEK_NONE)
+		return -ENXIO;
+	return vfs_setpos(filp, ps.offset, inode->i_sb->s_maxbytes);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+/* sendfile(2) and splice(2), same cache rules as prlfs_file_read_iter() */
+static ssize_t prlfs_splice_read(struct file *in, loff_t *ppos,
+				 struct pipe_inode_info *pipe, size_t len,
+				 unsigned int flags)
+{
+	struct dentry *dentry = FILE_DENTRY(in);
+	ssize_t ret;
+
+	if (PRLFS_SB(dentry->d_sb)->cache == PRLFS_CACHE_NONE)
+		return copy_splice_read(in, ppos, pipe, len, flags);
+	ret = prlfs_i_revalidate(dentry);
+	if (ret < 0 && ret != -ESTALE)
+		return ret;
+	return filemap_splice_read(in, ppos, pipe, len, flags);
+}
+#endif
+#else
 static ssize_t prlfs_read(struct file *filp, char *buf, size_t size,
 								loff_t *off)
 {
 	struct dentry *dentry = FILE_DENTRY(filp);
 	struct inode *inode = dentry->d_inode;
 
-	return prlfs_rw(inode, buf, size, off, 0, 1, TG_REQ_COMMON);
+	return prlfs_rw(inode, filp, buf, size, off, 0, 1, TG_REQ_COMMON);
 }
 
 static ssize_t prlfs_write(struct file *filp, const char *buf, size_t size,
@@ -445,7 +1240,8 @@ static ssize_t prlfs_write(struct file *filp, const char *buf, size_t size,
 		real_off = *off;
 
 	prlfs_inode_lock(inode);
-	ret = prlfs_rw(inode, (char *)buf, size, &real_off, 1, 1, TG_REQ_COMMON);
+	ret = prlfs_rw(inode, filp, (char *)buf, size, &real_off, 1, 1,
+		       TG_REQ_COMMON);
 	dentry->d_time = 0;
 	if (ret < 0)
 		goto out;
@@ -461,6 +1257,28 @@ out:
 	prlfs_inode_unlock(inode);
 	return ret;
 }
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
+/*
+ * Push dirty pages to the host, then ask it to put the file to the disk.
+ * Only durability requests get here: fsync(2), fdatasync(2), O_SYNC and
+ * O_DSYNC writes, and every write but with cache=writeback (sync flag).
+ */
+static int prlfs_fsync(struct file *filp, loff_t start, loff_t end,
+		       int datasync)
+{
+	struct inode *inode = filp->f_mapping->host;
+	struct prlfs_file_info pfi;
+	int ret;
+
+	ret = filemap_write_and_wait_range(filp->f_mapping, start, end);
+	if (ret < 0 || !PRLFS_SB(inode->i_sb)->flush)
+		return ret;
+	init_pfi(&pfi, PRLFS_F(filp)->pfd, 0, 0);
+	return host_request_flush(inode->i_sb, &pfi);
+}
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
 #ifdef PRL_SIMPLE_SYNC_FILE
@@ -473,12 +1291,39 @@ int simple_sync_file(struct file *filp, struct dentry *dentry, int datasync)
 
 struct file_operations prlfs_file_fops = {
 	.open		= prlfs_open,
+#ifdef PRLFS_ITER_IO
+	.read_iter	= prlfs_file_read_iter,
+	.write_iter	= prlfs_file_write_iter,
+#else
 	.read           = prlfs_read,
 	.write		= prlfs_write,
+#endif
+#ifdef PRLFS_ITER_IO
+	.llseek         = prlfs_llseek,
+#else
 	.llseek         = generic_file_llseek,
+#endif
 	.release	= prlfs_release,
 	.mmap		= generic_file_mmap,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#ifdef PRLFS_ITER_IO
+	.fallocate	= prlfs_fallocate,
+	/* through ->read_iter and ->write_iter, so every cache mode works */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read	= prlfs_splice_read,
+#else
+	.splice_read	= generic_file_splice_read,
+#endif
+	.splice_write	= iter_file_splice_write,
+	.copy_file_range = prlfs_copy_file_range,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	.remap_file_range = prlfs_remap_file_range,
+#else
+	.clone_file_range = prlfs_clone_file_range,
+#endif
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0)
+	.fsync		= prlfs_fsync,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
 	.fsync		= noop_fsync,
 #else
 	.fsync		= simple_sync_file,
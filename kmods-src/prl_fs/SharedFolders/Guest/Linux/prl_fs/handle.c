@@ -0,0 +1,366 @@
+/*
+ *	prlfs/handle.c
+ *
+ *	Copyright (C) 1999-2016 Parallels International GmbH
+ *
+ *	Parallels Linux shared folders filesystem
+ *
+ *	Idle host handles: the last close of a handle keeps it open on the
+ *	host for PRLFS_IDLE_TTL, so that a reopen does not go to the host.
+ *	Inodes with idle handles sit on a global LRU, pruned by a delayed
+ *	work, by a shrinker and when the file is removed or evicted.
+ */
+
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include "prlfs.h"
+
+static LIST_HEAD(prlfs_idle_lru);
+static DEFINE_SPINLOCK(prlfs_idle_lock);
+/* serializes pruners, so that umount waits for the inodes they hold */
+static DEFINE_MUTEX(prlfs_idle_mutex);
+static atomic_t prlfs_idle_count = ATOMIC_INIT(0);
+
+static atomic_long_t prlfs_handle_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t prlfs_handle_misses = ATOMIC_LONG_INIT(0);
+
+static void prlfs_idle_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(prlfs_idle_work, prlfs_idle_work_fn);
+
+/*
+ * Host handle for a request on the inode: the one of filp if there is a
+ * file, else a handle of other opens or an idle one, pinned then until
+ * prlfs_fd_put(). Reads (write == 0) never go to a write-only handle.
+ * Returns NULL if there is no handle for the request.
+ */
+struct prlfs_fd *prlfs_fd_get(struct inode *inode, struct file *filp,
+			      int write)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	unsigned int acc = write ? O_WRONLY : O_RDONLY;
+	struct prlfs_fd *pfd;
+
+	if (filp) {
+		/* open until the file is released, no pin needed */
+		pfd = PRLFS_F(filp)->pfd;
+		return prlfs_fd_allows(pfd, acc) ? pfd : NULL;
+	}
+	spin_lock(&pi->fd_lock);
+	pfd = &pi->pfd[O_RDWR];
+	if (!prlfs_fd_is_open(pfd))
+		pfd = &pi->pfd[acc];
+	if (prlfs_fd_is_open(pfd))
+		pfd->pin++;
+	else
+		pfd = NULL;
+	spin_unlock(&pi->fd_lock);
+	return pfd;
+}
+
+void prlfs_fd_put(struct inode *inode, struct file *filp,
+		  struct prlfs_fd *pfd)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	if (filp || pfd == NULL)
+		return;
+	spin_lock(&pi->fd_lock);
+	pfd->pin--;
+	spin_unlock(&pi->fd_lock);
+	wake_up_all(&pi->fd_wait);
+}
+
+static int prlfs_fd_pinned(struct prlfs_inode_info *pi, struct prlfs_fd *pfd)
+{
+	int pin;
+
+	spin_lock(&pi->fd_lock);
+	pin = pfd->pin;
+	spin_unlock(&pi->fd_lock);
+	return pin;
+}
+
+/*
+ * Releases the host handle, pi->open_lock must be held and f_counter be 0.
+ * Waits for the requests that pinned the handle before.
+ */
+void prlfs_fd_close(struct inode *inode, struct prlfs_fd *pfd)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	struct prlfs_file_info pfi;
+	int ret;
+
+	spin_lock(&pi->fd_lock);
+	pfd->idle = 0;
+	spin_unlock(&pi->fd_lock);
+	pfd->created = 0;
+	wait_event(pi->fd_wait, !prlfs_fd_pinned(pi, pfd));
+	init_pfi(&pfi, pfd, 0, 0);
+	ret = host_request_release(inode->i_sb, &pfi);
+	if (ret < 0)
+		printk(KERN_ERR "prlfs_release returns error (%d)\n", ret);
+}
+
+void prlfs_fd_stat(int hit)
+{
+	atomic_long_inc(hit ? &prlfs_handle_hits : &prlfs_handle_misses);
+}
+
+/*
+ * Keeps the unused handle open on the host, pi->open_lock must be held.
+ * Returns 0 if there is no room, the caller closes the handle then.
+ */
+int prlfs_idle_add(struct inode *inode, struct prlfs_fd *pfd)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	if (atomic_read(&prlfs_idle_count) >= PRLFS_IDLE_MAX)
+		return 0;
+	pfd->idle_mtime = inode->i_mtime.tv_sec;
+	pfd->idle_size = i_size_read(inode);
+	spin_lock(&pi->fd_lock);
+	pfd->idle = 1;
+	spin_unlock(&pi->fd_lock);
+	spin_lock(&prlfs_idle_lock);
+	pi->idle_since = jiffies;
+	if (list_empty(&pi->idle_lru))
+		atomic_inc(&prlfs_idle_count);
+	list_move(&pi->idle_lru, &prlfs_idle_lru);
+	spin_unlock(&prlfs_idle_lock);
+	schedule_delayed_work(&prlfs_idle_work, PRLFS_IDLE_TTL);
+	return 1;
+}
+
+static void prlfs_idle_del(struct prlfs_inode_info *pi)
+{
+	spin_lock(&prlfs_idle_lock);
+	if (!list_empty(&pi->idle_lru)) {
+		list_del_init(&pi->idle_lru);
+		atomic_dec(&prlfs_idle_count);
+	}
+	spin_unlock(&prlfs_idle_lock);
+}
+
+/* Puts the inode back to the LRU, as the most recently used one */
+static void prlfs_idle_requeue(struct prlfs_inode_info *pi)
+{
+	spin_lock(&prlfs_idle_lock);
+	if (list_empty(&pi->idle_lru)) {
+		list_add(&pi->idle_lru, &prlfs_idle_lru);
+		atomic_inc(&prlfs_idle_count);
+	}
+	spin_unlock(&prlfs_idle_lock);
+}
+
+/*
+ * Closes the idle handles of the inode. Unless wait is set pinned ones are
+ * left open: the writeback pinning them may wait for the reclaim we run in.
+ * *left is set if any are.
+ */
+static int prlfs_idle_close_locked(struct inode *inode, int wait, int *left)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	struct prlfs_fd *pfd;
+	int i, closed = 0, busy = 0, pinned;
+
+	for (i = 0; i < ARRAY_SIZE(pi->pfd); i++)
+		busy |= pi->pfd[i].f_counter != 0;
+	/* pages dirtied through mmap after the last close */
+	if (!busy)
+		filemap_write_and_wait(inode->i_mapping);
+	for (i = 0; i < ARRAY_SIZE(pi->pfd); i++) {
+		pfd = &pi->pfd[i];
+		if (!pfd->idle || pfd->f_counter)
+			continue;
+		if (!wait) {
+			spin_lock(&pi->fd_lock);
+			pinned = pfd->pin;
+			/* no new pins from now on */
+			if (!pinned)
+				pfd->idle = 0;
+			spin_unlock(&pi->fd_lock);
+			if (pinned) {
+				*left = 1;
+				continue;
+			}
+		}
+		prlfs_fd_close(inode, pfd);
+		closed++;
+	}
+	return closed;
+}
+
+/*
+ * Closes idle handles of the inode right away: before it is evicted, and
+ * before the host file is removed or renamed, which an open handle may
+ * prevent on some hosts.
+ */
+void prlfs_idle_close(struct inode *inode)
+{
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+
+	int left = 0;
+
+	mutex_lock(&pi->open_lock);
+	prlfs_idle_close_locked(inode, 1, &left);
+	/* under open_lock, nobody puts the inode back meanwhile */
+	prlfs_idle_del(pi);
+	mutex_unlock(&pi->open_lock);
+}
+
+/*
+ * Closes idle handles of up to nr inodes that are idle for age jiffies or
+ * longer, of sb only if it is not NULL. Returns the number of handles closed.
+ */
+static unsigned long prlfs_idle_prune(struct super_block *sb,
+				      unsigned long nr, unsigned long age)
+{
+	struct prlfs_inode_info *pi;
+	struct inode *inode;
+	unsigned long freed = 0;
+	int budget, found, left;
+
+	for (budget = atomic_read(&prlfs_idle_count); nr && budget > 0;
+	     budget--) {
+		found = 0;
+		inode = NULL;
+		spin_lock(&prlfs_idle_lock);
+		list_for_each_entry_reverse(pi, &prlfs_idle_lru, idle_lru) {
+			if (age && time_before(jiffies, pi->idle_since + age))
+				break;
+			if (sb && pi->vfs_inode.i_sb != sb)
+				continue;
+			list_del_init(&pi->idle_lru);
+			atomic_dec(&prlfs_idle_count);
+			/* fails if evicted, prlfs_evict_inode() closes them */
+			inode = igrab(&pi->vfs_inode);
+			found = 1;
+			break;
+		}
+		spin_unlock(&prlfs_idle_lock);
+		if (!found)
+			break;
+		if (inode == NULL)
+			continue;
+		/* trylock: we may be called by reclaim under an open_lock */
+		if (!mutex_trylock(&pi->open_lock)) {
+			prlfs_idle_requeue(pi);
+			iput(inode);
+			continue;
+		}
+		left = 0;
+		freed += prlfs_idle_close_locked(inode, 0, &left);
+		if (left)
+			prlfs_idle_requeue(pi);
+		mutex_unlock(&pi->open_lock);
+		iput(inode);
+		nr--;
+	}
+	return freed;
+}
+
+static void prlfs_idle_work_fn(struct work_struct *work)
+{
+	mutex_lock(&prlfs_idle_mutex);
+	prlfs_idle_prune(NULL, ULONG_MAX, PRLFS_IDLE_TTL);
+	mutex_unlock(&prlfs_idle_mutex);
+	if (atomic_read(&prlfs_idle_count))
+		schedule_delayed_work(&prlfs_idle_work, PRLFS_IDLE_TTL);
+}
+
+/* Called on umount, before the inodes of sb are evicted */
+void prlfs_idle_close_sb(struct super_block *sb)
+{
+	mutex_lock(&prlfs_idle_mutex);
+	prlfs_idle_prune(sb, ULONG_MAX, 0);
+	mutex_unlock(&prlfs_idle_mutex);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+static unsigned long prlfs_idle_shrink_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	return atomic_read(&prlfs_idle_count);
+}
+
+static unsigned long prlfs_idle_shrink_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	unsigned long freed;
+
+	/* closing a handle is a host request */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+	if (!mutex_trylock(&prlfs_idle_mutex))
+		return SHRINK_STOP;
+	freed = prlfs_idle_prune(NULL, sc->nr_to_scan, 0);
+	mutex_unlock(&prlfs_idle_mutex);
+	return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *prlfs_idle_shrinker;
+
+int prlfs_idle_init(void)
+{
+	prlfs_idle_shrinker = shrinker_alloc(0, "prlfs-idle");
+	if (prlfs_idle_shrinker == NULL)
+		return -ENOMEM;
+	prlfs_idle_shrinker->count_objects = prlfs_idle_shrink_count;
+	prlfs_idle_shrinker->scan_objects = prlfs_idle_shrink_scan;
+	shrinker_register(prlfs_idle_shrinker);
+	return 0;
+}
+
+static void prlfs_idle_shrinker_exit(void)
+{
+	shrinker_free(prlfs_idle_shrinker);
+}
+#else
+static struct shrinker prlfs_idle_shrinker = {
+	.count_objects	= prlfs_idle_shrink_count,
+	.scan_objects	= prlfs_idle_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+int prlfs_idle_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	return register_shrinker(&prlfs_idle_shrinker, "prlfs-idle");
+#else
+	return register_shrinker(&prlfs_idle_shrinker);
+#endif
+}
+
+static void prlfs_idle_shrinker_exit(void)
+{
+	unregister_shrinker(&prlfs_idle_shrinker);
+}
+#endif
+#else
+/* no shrinker, PRLFS_IDLE_MAX and PRLFS_IDLE_TTL bound the cache */
+int prlfs_idle_init(void)
+{
+	return 0;
+}
+
+static void prlfs_idle_shrinker_exit(void)
+{
+}
+#endif
+
+void prlfs_idle_exit(void)
+{
+	prlfs_idle_shrinker_exit();
+	cancel_delayed_work_sync(&prlfs_idle_work);
+}
+
+int prlfs_idle_stats_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "idle_handles %d\n", atomic_read(&prlfs_idle_count));
+	seq_printf(m, "handle_hits %ld\n",
+		   atomic_long_read(&prlfs_handle_hits));
+	seq_printf(m, "handle_misses %ld\n",
+		   atomic_long_read(&prlfs_handle_misses));
+	return 0;
+}
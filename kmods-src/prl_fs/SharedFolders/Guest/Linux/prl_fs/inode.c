@@ -16,6 +16,8 @@
 #include <linux/pagemap.h>
 #include <linux/namei.h>
 #include <linux/cred.h>
+#include <linux/vmalloc.h>
+#include <linux/writeback.h>
 
 extern struct file_operations prlfs_file_fops;
 extern struct file_operations prlfs_dir_fops;
@@ -28,6 +30,8 @@ static struct inode *prlfs_get_inode(struct super_block *sb,
 			int mode
 #endif
 );
+static struct inode *prlfs_attr_get_inode(struct super_block *sb,
+					  struct prlfs_attr *attr);
 struct dentry_operations prlfs_dentry_ops;
 
 #define PRLFS_UID_NOBODY  65534
@@ -45,7 +49,21 @@ static inline int prlfs_gid_valid(kgid_t gid)
 
 unsigned long *prlfs_dfl( struct dentry *de)
 {
-	return (unsigned long *)&(de->d_fsdata);
+	return &((struct prlfs_dentry_info *)de->d_fsdata)->flags;
+}
+
+struct prlfs_dentry_info *prlfs_dentry_info_alloc(void)
+{
+	return kmem_cache_zalloc(prlfs_dentry_cachep, GFP_KERNEL);
+}
+
+void prlfs_dentry_info_free(struct prlfs_dentry_info *di)
+{
+	if (di == NULL)
+		return;
+	if (di->path)
+		prlfs_path_put(di->path);
+	kmem_cache_free(prlfs_dentry_cachep, di);
 }
 
 void init_buffer_descriptor(struct buffer_descriptor *bd, void *buf,
@@ -113,7 +131,12 @@ out_lock:
 		*plen -= len;
 #else
 	p = dentry_path_raw(dentry, p, len);
+	/* room left in front of the path for the share name */
+	if (!IS_ERR(p))
+		len = p - (char *)buf;
 #endif
+	if (IS_ERR(p))
+		goto out;
 	ret = prepend(&p, &len,
 		PRLFS_SB(dentry->d_sb)->name,
 		strlen(PRLFS_SB(dentry->d_sb)->name));
@@ -123,36 +146,228 @@ out_lock:
 		*plen = strnlen(p, PAGE_SIZE-1) + 1;
 	else
 		p = ERR_PTR(ret);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 out:
-#endif
 	DPRINTK("EXIT returning %p\n", p);
 	return p;
 }
 
+void prlfs_path_put(struct prlfs_path *path)
+{
+	struct prlfs_path *parent;
+
+	/* a path holds a reference to the one of its parent */
+	while (path && atomic_dec_and_test(&path->count)) {
+		parent = path->parent;
+		kfree(path);
+		path = parent;
+	}
+}
+
+/* Path of the root, the only one walked out in full */
+static struct prlfs_path *prlfs_path_build_root(struct dentry *dentry)
+{
+	struct prlfs_path *path;
+	char *buf, *p;
+	int len = PATH_MAX;
+
+	buf = __getname();
+	if (buf == NULL)
+		return ERR_PTR(-ENOMEM);
+	p = prlfs_get_path(dentry, buf, &len);
+	if (IS_ERR(p)) {
+		path = (struct prlfs_path *)p;
+		goto out;
+	}
+	path = kmalloc(sizeof(struct prlfs_path) + len, GFP_KERNEL);
+	if (path == NULL) {
+		path = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	atomic_set(&path->count, 1);
+	path->parent = NULL;
+	path->len = len;
+	memcpy(path->buf, p, len);
+out:
+	__putname(buf);
+	return path;
+}
+
+static void prlfs_path_set(struct dentry *dentry, struct prlfs_path *path)
+{
+	struct prlfs_dentry_info *di = dentry->d_fsdata;
+	struct prlfs_path *old;
+
+	spin_lock(&dentry->d_lock);
+	old = di->path;
+	di->path = path;
+	spin_unlock(&dentry->d_lock);
+	if (old)
+		prlfs_path_put(old);
+}
+
+/*
+ * Drops the cached path of a dentry that moved. The paths of its subtree
+ * are built on the dropped one and so are rebuilt on their next use.
+ */
+static void prlfs_path_reset(struct dentry *dentry)
+{
+	prlfs_path_set(dentry, NULL);
+}
+
+/* Caches the path of dentry, built from the current one of its parent */
+static int prlfs_path_build(struct dentry *dentry)
+{
+	struct prlfs_path *ppath, *path;
+	struct dentry *parent;
+	char *p;
+	int len, sep;
+
+	if (IS_ROOT(dentry)) {
+		path = prlfs_path_build_root(dentry);
+		if (IS_ERR(path))
+			return PTR_ERR(path);
+		prlfs_path_set(dentry, path);
+		return 0;
+	}
+	parent = dget_parent(dentry);
+	spin_lock(&parent->d_lock);
+	ppath = ((struct prlfs_dentry_info *)parent->d_fsdata)->path;
+	if (ppath)
+		atomic_inc(&ppath->count);
+	spin_unlock(&parent->d_lock);
+	dput(parent);
+	/* the parent moved meanwhile, the caller looks up the tree again */
+	if (ppath == NULL)
+		return 0;
+	/* the root path ends with a '/' */
+	sep = ppath->buf[ppath->len - 2] != '/';
+retry:
+	len = dentry->d_name.len;
+	if (ppath->len + sep + len > PATH_MAX) {
+		prlfs_path_put(ppath);
+		return -ENAMETOOLONG;
+	}
+	path = kmalloc(sizeof(struct prlfs_path) + ppath->len + sep + len,
+		       GFP_KERNEL);
+	if (path == NULL) {
+		prlfs_path_put(ppath);
+		return -ENOMEM;
+	}
+	spin_lock(&dentry->d_lock);
+	if (dentry->d_name.len != len) {
+		/* renamed meanwhile */
+		spin_unlock(&dentry->d_lock);
+		kfree(path);
+		goto retry;
+	}
+	p = path->buf;
+	memcpy(p, ppath->buf, ppath->len - 1);
+	p += ppath->len - 1;
+	if (sep)
+		*p++ = '/';
+	memcpy(p, dentry->d_name.name, len);
+	p[len] = '\0';
+	spin_unlock(&dentry->d_lock);
+	atomic_set(&path->count, 1);
+	path->parent = ppath;
+	path->len = ppath->len + sep + len;
+	prlfs_path_set(dentry, path);
+	return 0;
+}
+
+/*
+ * Walks up from dentry and returns the topmost dentry whose cached path is
+ * missing or was built on another path of its parent than the cached one,
+ * referenced. Returns NULL if the path of dentry is up to date.
+ */
+static struct dentry *prlfs_path_stale(struct dentry *dentry)
+{
+	struct prlfs_dentry_info *di, *pdi;
+	struct dentry *d, *parent, *stale = NULL;
+	int fresh;
+
+	d = dget(dentry);
+	for (;;) {
+		di = d->d_fsdata;
+		if (IS_ROOT(d)) {
+			parent = NULL;
+			spin_lock(&d->d_lock);
+			fresh = di->path != NULL;
+			spin_unlock(&d->d_lock);
+		} else {
+			parent = dget_parent(d);
+			pdi = parent->d_fsdata;
+			spin_lock(&parent->d_lock);
+			spin_lock_nested(&d->d_lock, DENTRY_D_LOCK_NESTED);
+			fresh = d->d_parent == parent && di->path &&
+				di->path->parent == pdi->path;
+			spin_unlock(&d->d_lock);
+			spin_unlock(&parent->d_lock);
+		}
+		if (fresh) {
+			dput(d);
+		} else {
+			if (stale)
+				dput(stale);
+			stale = d;
+		}
+		if (parent == NULL)
+			return stale;
+		d = parent;
+	}
+}
+
+/*
+ * Returns a referenced host path of the dentry. The path is cached in the
+ * dentry and built from the path of its parent, so hot operations do not
+ * copy names out of the dcache or allocate PATH_MAX buffers, checking the
+ * cached paths up to the root is enough. A rename outdates only the paths
+ * of the subtree it moved.
+ */
+struct prlfs_path *prlfs_path_get(struct dentry *dentry)
+{
+	struct prlfs_dentry_info *di = dentry->d_fsdata;
+	struct prlfs_path *path;
+	struct dentry *stale;
+	int ret;
+
+	for (;;) {
+		/* top down, every path is built on an up to date parent */
+		while ((stale = prlfs_path_stale(dentry)) != NULL) {
+			ret = prlfs_path_build(stale);
+			dput(stale);
+			if (ret < 0)
+				return ERR_PTR(ret);
+		}
+		spin_lock(&dentry->d_lock);
+		path = di->path;
+		if (path)
+			atomic_inc(&path->count);
+		spin_unlock(&dentry->d_lock);
+		if (path)
+			return path;
+	}
+}
+
 #define PRLFS_STD_INODE_HEAD(d)			\
-	char *buf, *p;				\
+	struct prlfs_path *path;		\
+	char *p;				\
 	int buflen, ret;			\
 	struct super_block *sb;			\
 						\
 	DPRINTK("ENTER\n");			\
-	buflen = PATH_MAX;			\
-	buf = kmalloc(buflen, GFP_KERNEL);	\
-	if (buf == NULL) {			\
-		ret = -ENOMEM;			\
+	path = prlfs_path_get(d);		\
+	if (IS_ERR(path)) {			\
+		ret = PTR_ERR(path);		\
 		goto out;			\
 	}					\
-	memset(buf, 0, buflen);			\
-	p = prlfs_get_path((d), buf, &buflen);	\
-	if (IS_ERR(p)) {			\
-		ret = PTR_ERR(p);		\
-		goto out_free;			\
-	}					\
+	p = path->buf;				\
+	buflen = path->len;			\
 	sb = (d)->d_sb;
 
 #define PRLFS_STD_INODE_TAIL			\
 out_free:					\
-	kfree(buf);				\
+	prlfs_path_put(path);			\
 out:						\
 	DPRINTK("EXIT returning %d\n", ret);	\
 	return ret;
@@ -190,15 +405,60 @@ static int do_prlfs_getattr(struct dentry *dentry, struct prlfs_attr *attr)
 #define SET_INODE_INO(inode, ino) do { (inode)->i_ino = ino; } while (0)
 #endif
 
+/*
+ * Attributes of a file that does not change are trusted longer and longer,
+ * from the min to the max lifetime of the mount; any change starts over.
+ */
+static void prlfs_attr_timeo(struct inode *inode, struct prlfs_attr *attr)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(inode->i_sb);
+	struct prlfs_inode_info *pi = PRLFS_I(inode);
+	unsigned long min, max;
+
+	if (S_ISDIR(inode->i_mode)) {
+		min = sbi->dir_min;
+		max = sbi->dir_max;
+	} else {
+		min = sbi->attr_min;
+		max = sbi->attr_max;
+	}
+	if (((attr->valid & _PATTR_MTIME) &&
+	     inode->i_mtime.tv_sec != attr->mtime) ||
+	    ((attr->valid & _PATTR_SIZE) && i_size_read(inode) != attr->size))
+		pi->attr_timeo = min;
+	else
+		pi->attr_timeo = clamp(pi->attr_timeo * 2, min, max);
+}
+
 static void prlfs_change_attributes(struct inode *inode,
 				    struct prlfs_attr *attr)
 {
 	struct prlfs_sb_info *sbi = PRLFS_SB(inode->i_sb);
 
-	if (attr->valid & _PATTR_SIZE) {
+	/* a symlink replaced on the host points elsewhere */
+	if (S_ISLNK(inode->i_mode) &&
+	    (((attr->valid & _PATTR_MTIME) &&
+	      inode->i_mtime.tv_sec != attr->mtime) ||
+	     ((attr->valid & _PATTR_CTIME) &&
+	      inode->i_ctime.tv_sec != attr->ctime) ||
+	     ((attr->valid & _PATTR_SIZE) && i_size_read(inode) != attr->size)))
+		prlfs_link_drop(inode);
+	prlfs_attr_timeo(inode, attr);
+	/*
+	 * The host does not see the size of dirty page cache or of writes on
+	 * their way yet, keep ours. Writeback counts as in flight from before
+	 * the dirty tag is cleared, see prlfs_writepages().
+	 */
+	spin_lock(&PRLFS_I(inode)->wr_lock);
+	if ((attr->valid & _PATTR_SIZE) &&
+	    !(attr->size < i_size_read(inode) &&
+	      (atomic_read(&PRLFS_I(inode)->wr_pending) ||
+	       mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+	       mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK)))) {
 		inode->i_blocks = ((attr->size + PAGE_SIZE - 1) / PAGE_SIZE) * 8;
 		i_size_write(inode, attr->size);
 	}
+	spin_unlock(&PRLFS_I(inode)->wr_lock);
 	if (attr->valid & _PATTR_ATIME)
 		SET_INODE_TIME(inode->i_atime, attr->atime);
 	if (attr->valid & _PATTR_MTIME)
@@ -219,12 +479,77 @@ static void prlfs_change_attributes(struct inode *inode,
 		else if (sbi->plain)
 			inode->i_gid = prl_make_kgid(attr->gid);
 	}
-	if (sbi->host_inodes && (attr->valid & _PATTR2_INO)) {
-		SET_INODE_INO(inode, attr->ino);
-	}
 	return;
 }
 
+/*
+ * Do the attributes belong to the host file of the inode? With host inode
+ * numbers a new number means the name leads to another file now.
+ */
+static int prlfs_attr_match(struct inode *inode, struct prlfs_attr *attr)
+{
+	if (!PRLFS_SB(inode->i_sb)->host_inodes ||
+	    !(attr->valid & _PATTR2_INO) || attr->ino == 0)
+		return 1;
+	return PRLFS_I(inode)->host_ino == attr->ino;
+}
+
+/*
+ * The host file of the inode was removed or replaced, by its last name:
+ * the inode must not be found by its host number anymore, the number may
+ * be reused.
+ */
+static void prlfs_inode_gone(struct inode *inode)
+{
+	clear_nlink(inode);
+	if (PRLFS_I(inode)->host_ino == 0)
+		return;
+	remove_inode_hash(inode);
+	/* as prlfs_get_inode() does, pages of open files are still written */
+	if (S_ISREG(inode->i_mode)) {
+		spin_lock(&inode->i_lock);
+		prlfs_hlist_init(inode);
+		spin_unlock(&inode->i_lock);
+	}
+}
+
+/* Names of the inode in the dcache other than dentry */
+static unsigned int prlfs_inode_names(struct inode *inode,
+				      struct dentry *dentry)
+{
+	struct dentry *alias;
+	unsigned int n = 0;
+
+	spin_lock(&inode->i_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	hlist_for_each_entry(alias, &inode->i_dentry, d_u.d_alias)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+	hlist_for_each_entry(alias, &inode->i_dentry, d_alias)
+#else
+	list_for_each_entry(alias, &inode->i_dentry, d_alias)
+#endif
+		if (alias != dentry && !d_unhashed(alias))
+			n++;
+	spin_unlock(&inode->i_lock);
+	return n;
+}
+
+/*
+ * The name dentry of a file was removed on the host. The host does not
+ * report link counts, the other names in the dcache stand in for them:
+ * while there are any the inode keeps its hash, so that all the names
+ * share one page cache.
+ */
+static void prlfs_inode_unlinked(struct inode *inode, struct dentry *dentry)
+{
+	unsigned int n = prlfs_inode_names(inode, dentry);
+
+	if (n == 0)
+		prlfs_inode_gone(inode);
+	else
+		set_nlink(inode, n);
+}
+
 static int attr_to_pattr(struct iattr *attr, struct prlfs_attr *pattr)
 {
 	int ret;
@@ -271,6 +596,8 @@ static int prlfs_mknod(struct inode *dir, struct dentry *dentry, int mode)
 	DPRINTK("ENTER\n");
 	ret = 0;
 	dentry->d_time = 0;
+	/* may be a cached negative dentry of an unlinked file */
+	*prlfs_dfl(dentry) &= ~PRL_DFL_UNLINKED;
 	inode = prlfs_get_inode(dir->i_sb, mode);
 	if (inode)
 		d_instantiate(dentry, inode);
@@ -280,6 +607,75 @@ static int prlfs_mknod(struct inode *dir, struct dentry *dentry, int mode)
         return ret;
 }
 
+/*
+ * Creates the host file of a negative dentry and instantiates the dentry
+ * with the attributes that come back in the same request. The host handle
+ * the file is created with is kept as an idle one for the ->open that
+ * follows, which so does not go to the host again. The create is exclusive:
+ * -EEXIST if the host has a file of that name already.
+ */
+static int prlfs_create_open(struct inode *dir, struct dentry *dentry,
+			     int mode)
+{
+	struct prlfs_file_info pfi;
+	struct prlfs_attr *attr;
+	struct inode *inode;
+	struct prlfs_inode_info *pi;
+	struct prlfs_fd *pfd;
+	PRLFS_STD_INODE_HEAD(dentry)
+	/* whatever the outcome, the negative dentry is no longer trusted */
+	dentry->d_time = 0;
+	attr = kmem_cache_alloc(prlfs_attr_cachep, GFP_KERNEL);
+	if (!attr) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	init_pfi(&pfi, NULL, mode, O_CREAT | O_EXCL | O_RDWR);
+	ret = host_request_open_attr(sb, &pfi, p, buflen, attr);
+	if (ret < 0) {
+		/* TG_STATUS_OBJECT_NAME_COLLISION */
+		if (ret == -ESTALE)
+			ret = -EEXIST;
+		goto out_attr;
+	}
+
+	/* may be a cached negative dentry of an unlinked file */
+	*prlfs_dfl(dentry) &= ~PRL_DFL_UNLINKED;
+	if (attr->valid & _PATTR_MODE)
+		inode = prlfs_attr_get_inode(sb, attr);
+	else
+		inode = prlfs_get_inode(sb, mode);
+	if (inode == NULL) {
+		host_request_release(sb, &pfi);
+		ret = -ENOSPC;
+		goto out_attr;
+	}
+	pi = PRLFS_I(inode);
+	pfd = &pi->pfd[O_RDWR];
+	mutex_lock(&pi->open_lock);
+	if (prlfs_fd_is_open(pfd)) {
+		host_request_release(sb, &pfi);
+	} else {
+		pfd->fd = pfi.fd;
+		pfd->sfid = pfi.sfid;
+		pfd->f_flags = O_RDWR;
+		pfd->created = 1;
+		if (!prlfs_idle_add(inode, pfd))
+			prlfs_fd_close(inode, pfd);
+	}
+	mutex_unlock(&pi->open_lock);
+	if (attr->valid & _PATTR_MODE)
+		dentry->d_time = jiffies;
+	/* a dentry of prlfs_atomic_open() may still be in lookup */
+	if (d_unhashed(dentry))
+		d_add(dentry, inode);
+	else
+		d_instantiate(dentry, inode);
+out_attr:
+	kmem_cache_free(prlfs_attr_cachep, attr);
+	PRLFS_STD_INODE_TAIL
+}
+
 static int prlfs_create(struct inode *dir, struct dentry *dentry,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
 			umode_t mode
@@ -293,14 +689,38 @@ static int prlfs_create(struct inode *dir, struct dentry *dentry,
 #endif
 	)
 {
-	int ret;
+	return prlfs_create_open(dir, dentry, mode | S_IFREG);
+}
 
-	DPRINTK("ENTER\n");
-	ret = prlfs_inode_open(dentry, mode | S_IFREG);
-	if (ret == 0)
-		ret = prlfs_mknod(dir, dentry, mode | S_IFREG);
-	DPRINTK("EXIT returning %d\n", ret);
-        return ret;
+/* Sets up a dentry before the host is asked about it */
+static int prlfs_dentry_setup(struct dentry *dentry)
+{
+	/* set already if an exclusive create of it collided */
+	if (dentry->d_fsdata == NULL) {
+		dentry->d_fsdata = prlfs_dentry_info_alloc();
+		if (dentry->d_fsdata == NULL)
+			return -ENOMEM;
+	}
+	if (dentry->d_op == NULL)
+		d_set_d_op(dentry, &prlfs_dentry_ops);
+	return 0;
+}
+
+/*
+ * d_splice_alias() moves an existing alias of a directory inode to the new
+ * place, which outdates the cached path of the alias and of its subtree.
+ */
+static struct dentry *prlfs_splice_alias(struct inode *inode,
+					 struct dentry *dentry)
+{
+	struct dentry *alias;
+
+	alias = d_splice_alias(inode, dentry);
+	if (alias && !IS_ERR(alias)) {
+		alias->d_time = jiffies;
+		prlfs_path_reset(alias);
+	}
+	return alias;
 }
 
 static struct dentry *prlfs_lookup(struct inode *dir, struct dentry *dentry
@@ -314,15 +734,20 @@ static struct dentry *prlfs_lookup(struct inode *dir, struct dentry *dentry
 	int ret;
 	struct prlfs_attr *attr = 0;
 	struct inode *inode;
+	struct dentry *res = NULL;
 
 	DPRINTK("ENTER\n");
 	DPRINTK("dir ino %lld entry name \"%s\"\n",
 		 (u64)dir->i_ino, dentry->d_name.name);
-	attr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
+	attr = kmem_cache_alloc(prlfs_attr_cachep, GFP_KERNEL);
 	if (!attr) {
 		ret = -ENOMEM;
 		goto out;
 	}
+	/* the path cache is needed right away, for the getattr below */
+	ret = prlfs_dentry_setup(dentry);
+	if (ret < 0)
+		goto out_free;
 	ret = do_prlfs_getattr(dentry, attr);
 	if (ret < 0 ) {
 		if (ret == -ENOENT) {
@@ -330,19 +755,150 @@ static struct dentry *prlfs_lookup(struct inode *dir, struct dentry *dentry
 			ret = 0;
 		} else
 			goto out_free;
-	} else {
-		inode = prlfs_get_inode(dentry->d_sb, attr->mode);
-		if (inode)
-			prlfs_change_attributes(inode, attr);
-	}
+	} else
+		inode = prlfs_attr_get_inode(dentry->d_sb, attr);
 	dentry->d_time = jiffies;
-	d_add(dentry, inode);
-	d_set_d_op(dentry, &prlfs_dentry_ops);
+	res = prlfs_splice_alias(inode, dentry);
 out_free:
-	kfree(attr);
+	kmem_cache_free(prlfs_attr_cachep, attr);
+out:
+	if (ret)
+		res = ERR_PTR(ret);
+	DPRINTK("EXIT returning %p\n", res);
+	return res;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define prlfs_d_in_lookup(dentry) d_in_lookup(dentry)
+#else
+#define prlfs_d_in_lookup(dentry) d_unhashed(dentry)
+#endif
+
+/*
+ * open(O_CREAT) of a name not known to exist: the host creates and opens
+ * the file by one exclusive request, and the dentry is instantiated from
+ * the attributes that come with it, without a lookup before. The handle is
+ * reused by the ->open called by finish_open(). If the host has the file
+ * already, it is looked up and left to the usual open, as is everything
+ * without O_CREAT.
+ */
+static int prlfs_atomic_open(struct inode *dir, struct dentry *dentry,
+			     struct file *file, unsigned open_flag,
+			     umode_t mode
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,19,0)
+			     , int *opened
+#endif
+	)
+{
+	struct dentry *res = NULL;
+	int in_lookup = prlfs_d_in_lookup(dentry);
+	int ret;
+
+	DPRINTK("ENTER\n");
+	if (!(open_flag & O_CREAT)) {
+		if (in_lookup)
+			goto lookup;
+		ret = finish_no_open(file, NULL);
+		goto out;
+	}
+	if (in_lookup) {
+		ret = prlfs_dentry_setup(dentry);
+		if (ret < 0)
+			goto out;
+	}
+	ret = prlfs_create_open(dir, dentry, mode | S_IFREG);
+	if (ret == 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,19,0)
+		*opened |= FILE_CREATED;
+		ret = finish_open(file, dentry, NULL, opened);
+#else
+		file->f_mode |= FMODE_CREATED;
+		ret = finish_open(file, dentry, NULL);
+#endif
+		goto out;
+	}
+	if (ret != -EEXIST)
+		goto out;
+	/* made on the host behind our back, O_EXCL fails in the VFS then */
+	if (!in_lookup)
+		d_drop(dentry);
+lookup:
+	res = prlfs_lookup(dir, dentry, 0);
+	if (IS_ERR(res)) {
+		ret = PTR_ERR(res);
+		goto out;
+	}
+	ret = finish_no_open(file, res);
 out:
 	DPRINTK("EXIT returning %d\n", ret);
-	return ERR_PTR(ret);
+	return ret;
+}
+#endif
+
+/*
+ * Instantiates a child dentry from a READDIRPLUS entry, so that lookups and
+ * stats following the listing are served from the dcache. The directory is
+ * locked exclusively by readdir, so no lookup of the same name races with us.
+ * Returns the inode number of the child or 0 if nothing was cached.
+ */
+ino_t prlfs_dentry_prime(struct dentry *parent, const char *name, int len,
+			 struct prlfs_attr *attr)
+{
+	struct dentry *dentry, *alias;
+	struct inode *inode;
+	struct qstr q;
+	ino_t ino = 0;
+
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return 0;
+	q.name = name;
+	q.len = len;
+	dentry = d_hash_and_lookup(parent, &q);
+	if (IS_ERR(dentry))
+		return 0;
+	if (dentry && dentry->d_inode == NULL) {
+		/* a cached miss of a name that exists now, replaced below */
+		d_drop(dentry);
+		dput(dentry);
+		dentry = NULL;
+	}
+	if (dentry) {
+		inode = dentry->d_inode;
+		if (!is_bad_inode(inode) &&
+		    !((inode->i_mode ^ attr->mode) & S_IFMT) &&
+		    prlfs_attr_match(inode, attr)) {
+			prlfs_change_attributes(inode, attr);
+			dentry->d_time = jiffies;
+			ino = inode->i_ino;
+		} else {
+			/* another file now, the next revalidation sees it */
+			dentry->d_time = 0;
+		}
+		dput(dentry);
+		return ino;
+	}
+
+	dentry = d_alloc(parent, &q);
+	if (dentry == NULL)
+		return 0;
+	dentry->d_fsdata = prlfs_dentry_info_alloc();
+	if (dentry->d_fsdata == NULL)
+		goto out_dput;
+	d_set_d_op(dentry, &prlfs_dentry_ops);
+	inode = prlfs_attr_get_inode(parent->d_sb, attr);
+	if (inode == NULL)
+		goto out_dput;
+	ino = inode->i_ino;
+	dentry->d_time = jiffies;
+	alias = prlfs_splice_alias(inode, dentry);
+	if (IS_ERR(alias))
+		ino = 0;
+	else if (alias)
+		dput(alias);
+out_dput:
+	dput(dentry);
+	return ino;
 }
 
 static int prlfs_unlink(struct inode *dir, struct dentry *dentry)
@@ -351,9 +907,15 @@ static int prlfs_unlink(struct inode *dir, struct dentry *dentry)
 	unsigned long *dfl = prlfs_dfl(dentry);
 
 	DPRINTK("ENTER\n");
+	/* idle host handles may keep the host file from being removed */
+	prlfs_idle_close(dentry->d_inode);
 	ret = prlfs_delete(dentry);
-	if (!ret)
-		 *dfl |= PRL_DFL_UNLINKED;
+	if (!ret) {
+		*dfl |= PRL_DFL_UNLINKED;
+		/* valid as a negative dentry once d_delete()'d */
+		dentry->d_time = jiffies;
+		prlfs_inode_unlinked(dentry->d_inode, dentry);
+	}
 	DPRINTK("EXIT returning %d\n", ret);
         return ret;
 }
@@ -369,6 +931,7 @@ static int prlfs_mkdir(struct inode *dir, struct dentry *dentry,
         int ret;
 
 	DPRINTK("ENTER\n");
+	dentry->d_time = 0;
 	ret = prlfs_inode_open(dentry, mode | S_IFDIR);
 	if (ret == 0)
 		ret = prlfs_mknod(dir, dentry, mode | S_IFDIR);
@@ -382,9 +945,13 @@ static int prlfs_rmdir(struct inode *dir, struct dentry *dentry)
 	unsigned long *dfl = prlfs_dfl(dentry);
 
 	DPRINTK("ENTER\n");
+	prlfs_idle_close(dentry->d_inode);
 	ret = prlfs_delete(dentry);
-	if (!ret)
+	if (!ret) {
 		*dfl |= PRL_DFL_UNLINKED;
+		dentry->d_time = jiffies;
+		prlfs_inode_gone(dentry->d_inode);
+	}
 	DPRINTK("EXIT returning %d\n", ret);
         return ret;
 }
@@ -392,26 +959,31 @@ static int prlfs_rmdir(struct inode *dir, struct dentry *dentry)
 static int prlfs_rename(struct inode *old_dir, struct dentry *old_de,
 			struct inode *new_dir, struct dentry *new_de)
 {
-	void *np, *nbuf;
-	int nbuflen;
+	struct prlfs_path *npath;
+	struct inode *victim = new_de->d_inode;
 	PRLFS_STD_INODE_HEAD(old_de)
-	nbuflen = PATH_MAX;
-	nbuf = kmalloc(nbuflen, GFP_KERNEL);
-	if (nbuf == NULL) {
-		ret = -ENOMEM;
+	prlfs_idle_close(old_de->d_inode);
+	if (victim)
+		prlfs_idle_close(victim);
+	npath = prlfs_path_get(new_de);
+	if (IS_ERR(npath)) {
+		ret = PTR_ERR(npath);
 		goto out_free;
 	}
-	memset(nbuf, 0, nbuflen);
-	np = prlfs_get_path(new_de, nbuf, &nbuflen);
-	if (IS_ERR(np)) {
-		ret = PTR_ERR(np);
-		goto out_free_nbuf;
-	}
-	ret = host_request_rename(sb, p, buflen, np, nbuflen);
+	ret = host_request_rename(sb, p, buflen, npath->buf, npath->len);
+	prlfs_path_put(npath);
 	old_de->d_time = 0;
 	new_de->d_time = 0;
-out_free_nbuf:
-	kfree(nbuf);
+	if (ret == 0) {
+		/* FS_RENAME_DOES_D_MOVE, then the moved paths are outdated */
+		d_move(old_de, new_de);
+		prlfs_path_reset(old_de);
+		prlfs_path_reset(new_de);
+		if (victim && S_ISDIR(victim->i_mode))
+			prlfs_inode_gone(victim);
+		else if (victim)
+			prlfs_inode_unlinked(victim, new_de);
+	}
 	PRLFS_STD_INODE_TAIL
 }
 
@@ -462,7 +1034,7 @@ static int prlfs_setattr(struct dentry *dentry, struct iattr *attr)
 	struct prlfs_attr *pattr;
 	struct buffer_descriptor bd;
 	PRLFS_STD_INODE_HEAD(dentry)
-	pattr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
+	pattr = kmem_cache_alloc(prlfs_attr_cachep, GFP_KERNEL);
 	if (!pattr) {
 		ret = -ENOMEM;
 		goto out_free;
@@ -470,6 +1042,11 @@ static int prlfs_setattr(struct dentry *dentry, struct iattr *attr)
 	ret = attr_to_pattr(attr, pattr);
 	if (ret < 0)
 		goto out_free_pattr;
+#ifdef PRLFS_ITER_IO
+	/* let in-flight aio settle before the host file changes its size */
+	if (attr->ia_valid & ATTR_SIZE)
+		inode_dio_wait(dentry->d_inode);
+#endif
 
 	if (check_dentry(dentry)) {
 		ret = - ESTALE;
@@ -479,16 +1056,61 @@ static int prlfs_setattr(struct dentry *dentry, struct iattr *attr)
 	ret = host_request_attr(sb, p, buflen, &bd);
 	if (ret == 0)
 		ret = prlfs_inode_setattr(dentry->d_inode, attr);
+	PRLFS_I(dentry->d_inode)->cto_written = 1;
 	dentry->d_time = 0;
 out_free_pattr:
-	kfree(pattr);
+	kmem_cache_free(prlfs_attr_cachep, pattr);
 	PRLFS_STD_INODE_TAIL
 }
 
-static int prlfs_i_revalidate(struct dentry *dentry)
+/* May the cached attributes of the dentry be used without asking the host? */
+static int prlfs_dentry_fresh(struct dentry *dentry)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(dentry->d_sb);
+	struct inode *inode = dentry->d_inode;
+	unsigned long ttl = inode ? PRLFS_I(inode)->attr_timeo : sbi->neg_ttl;
+
+	if (ttl == 0)
+		return 0;
+	if (sbi->notify && ttl < PRLFS_NOTIFY_TTL)
+		ttl = PRLFS_NOTIFY_TTL;
+	if (dentry->d_time == 0 || jiffies - dentry->d_time >= ttl)
+		return 0;
+	/* the host lost track of changes after the dentry was cached */
+	if (jiffies - sbi->inval_time < ttl &&
+	    (long)(dentry->d_time - sbi->inval_time) <= 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * Takes attributes the host sent along with another request. Returns
+ * -ESTALE if they are of another host file than the one of the inode.
+ */
+int prlfs_i_update(struct dentry *dentry, struct prlfs_attr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+
+	/* the root inode is not hashed by its host number */
+	if (!IS_ROOT(dentry) && !prlfs_attr_match(inode, attr)) {
+		DPRINTK("inode <%p> host ino %llu attr->ino %llu\n", inode,
+			PRLFS_I(inode)->host_ino, attr->ino);
+		return -ESTALE;
+	}
+	if ((inode->i_mode ^ attr->mode) & S_IFMT) {
+		DPRINTK("inode <%p> i_mode %x attr->mode %x\n", inode, inode->i_mode,
+				attr->mode);
+		make_bad_inode(inode);
+		return -EIO;
+	}
+	prlfs_change_attributes(inode, attr);
+	dentry->d_time = jiffies;
+	return 0;
+}
+
+int prlfs_i_revalidate(struct dentry *dentry)
 {
 	struct prlfs_attr *attr = 0;
-	struct inode *inode;
 	int ret;
 
 	DPRINTK("ENTER\n");
@@ -496,32 +1118,19 @@ static int prlfs_i_revalidate(struct dentry *dentry)
 		ret = -ENOENT;
 		goto out;
 	}
-	if (dentry->d_time != 0 &&
-	    jiffies - dentry->d_time < PRLFS_SB(dentry->d_sb)->ttl) {
+	if (prlfs_dentry_fresh(dentry)) {
 		ret = 0;
 		goto out;
 	}
-	attr = kmalloc(sizeof(struct prlfs_attr), GFP_KERNEL);
+	attr = kmem_cache_alloc(prlfs_attr_cachep, GFP_KERNEL);
 	if (!attr) {
 		ret = -ENOMEM;
 		goto out;
 	}
-	inode = dentry->d_inode;
 	ret = do_prlfs_getattr(dentry, attr);
-	if (ret < 0)
-		goto out_free;
-
-	if ((inode->i_mode ^ attr->mode) & S_IFMT) {
-		DPRINTK("inode <%p> i_mode %x attr->mode %x\n", inode, inode->i_mode,
-				attr->mode);
-		make_bad_inode(inode);
-		ret = -EIO;
-	} else {
-		prlfs_change_attributes(inode, attr);
-	}
-	dentry->d_time = jiffies;
-out_free:
-	kfree(attr);
+	if (ret == 0)
+		ret = prlfs_i_update(dentry, attr);
+	kmem_cache_free(prlfs_attr_cachep, attr);
 out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
@@ -535,16 +1144,39 @@ static int prlfs_d_revalidate(struct dentry *dentry,
 #endif
 	)
 {
-	int ret;
+	int ret, rcu;
 
 	DPRINTK("ENTER\n");
-	ret = (prlfs_i_revalidate(dentry) == 0) ? 1 : 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	rcu = flags & LOOKUP_RCU;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	rcu = nd && (nd->flags & LOOKUP_RCU);
+#else
+	rcu = 0;
+#endif
+	if (prlfs_dentry_fresh(dentry))
+		ret = 1;
+	else if (rcu)
+		/* asking the host may sleep */
+		ret = -ECHILD;
+	else if (dentry->d_inode == NULL)
+		/* expired negative dentry, look the name up again */
+		ret = 0;
+	else
+		ret = (prlfs_i_revalidate(dentry) == 0) ? 1 : 0;
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
 
+static void prlfs_d_release(struct dentry *dentry)
+{
+	prlfs_dentry_info_free(dentry->d_fsdata);
+	dentry->d_fsdata = NULL;
+}
+
 struct dentry_operations prlfs_dentry_ops = {
 	.d_revalidate = prlfs_d_revalidate,
+	.d_release = prlfs_d_release,
 };
 
 
@@ -558,6 +1190,9 @@ inline int __prlfs_getattr(struct dentry *dentry, struct kstat *stat)
 	}
 
 	ret = prlfs_i_revalidate(dentry);
+	/* the name leads to another file, an open one still has its own */
+	if (ret == -ESTALE)
+		ret = 0;
 	if (ret < 0)
 		goto out;
 
@@ -652,39 +1287,115 @@ static int prlfs_permission(struct inode *inode, int mask)
 
 static char *do_read_symlink(struct dentry *dentry)
 {
-	char *buf, *src_path, *tgt_path;
-	int src_len, tgt_len, ret;
+	struct prlfs_path *src_path;
+	char *tgt_path;
+	int tgt_len, ret;
 
-	tgt_path = NULL;
-	src_len = tgt_len = PATH_MAX;
-	buf = kmalloc(src_len, GFP_KERNEL);
-	if (buf == NULL) {
-		tgt_path = ERR_PTR(-ENOMEM);
-		goto out;
-	}
-	memset(buf, 0, src_len);
-	src_path = prlfs_get_path(dentry, buf, &src_len);
+	tgt_len = PATH_MAX;
+	src_path = prlfs_path_get(dentry);
 	if (IS_ERR(src_path)) {
-		tgt_path = src_path;
-		goto out_free;
+		tgt_path = (char *)src_path;
+		goto out;
 	}
 
 	tgt_path = kmalloc(tgt_len, GFP_KERNEL);
-	if (IS_ERR(tgt_path))
-		goto out_free;
-	DPRINTK("src '%s'\n", src_path);
-	ret = host_request_readlink(dentry->d_sb, src_path, src_len, tgt_path, tgt_len);
+	if (tgt_path == NULL) {
+		tgt_path = ERR_PTR(-ENOMEM);
+		goto out_put;
+	}
+	DPRINTK("src '%s'\n", src_path->buf);
+	ret = host_request_readlink(dentry->d_sb, src_path->buf, src_path->len,
+				    tgt_path, tgt_len);
 	if (ret < 0) {
 		kfree(tgt_path);
 		tgt_path = ERR_PTR(ret);
 	} else
 		DPRINTK("tgt '%s'\n", tgt_path);
-out_free:
-	kfree(buf);
+out_put:
+	prlfs_path_put(src_path);
 out:
 	return tgt_path;
 }
 
+static void prlfs_link_put(void *arg)
+{
+	struct prlfs_link *link = arg;
+
+	if (link && atomic_dec_and_test(&link->count))
+		kfree_rcu(link, rcu);
+}
+
+void prlfs_link_drop(struct inode *inode)
+{
+	prlfs_link_put(xchg(&PRLFS_I(inode)->link, NULL));
+}
+
+/* Caches the target, returns a reference to it or NULL */
+static struct prlfs_link *prlfs_link_set(struct inode *inode,
+					 const char *target, int len)
+{
+	struct prlfs_link *link;
+
+	link = kmalloc(sizeof(*link) + len + 1, GFP_KERNEL);
+	if (link == NULL)
+		return NULL;
+	memcpy(link->target, target, len);
+	link->target[len] = 0;
+	/* one for the inode and one for the caller */
+	atomic_set(&link->count, 2);
+	prlfs_link_put(xchg(&PRLFS_I(inode)->link, link));
+	return link;
+}
+
+/* Safe in RCU walk, the link is freed after a grace period */
+static struct prlfs_link *prlfs_link_get_cached(struct inode *inode)
+{
+	struct prlfs_link *link;
+
+	rcu_read_lock();
+	link = rcu_dereference(PRLFS_I(inode)->link);
+	if (link && !atomic_inc_not_zero(&link->count))
+		link = NULL;
+	rcu_read_unlock();
+	return link;
+}
+
+/*
+ * The target is read from the host once and then served from the inode,
+ * until the attribute revalidation sees the symlink changed.
+ */
+static struct prlfs_link *prlfs_link_get(struct dentry *dentry)
+{
+	struct prlfs_link *link;
+	char *target;
+
+	link = prlfs_link_get_cached(dentry->d_inode);
+	if (link)
+		return link;
+	target = do_read_symlink(dentry);
+	if (IS_ERR(target))
+		return ERR_CAST(target);
+	link = prlfs_link_set(dentry->d_inode, target,
+			      strnlen(target, PATH_MAX - 1));
+	kfree(target);
+	return link ? link : ERR_PTR(-ENOMEM);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+/* the VFS frees what ->follow_link returns, give it a copy */
+static char *prlfs_read_symlink_copy(struct dentry *dentry)
+{
+	struct prlfs_link *link = prlfs_link_get(dentry);
+	char *s;
+
+	if (IS_ERR(link))
+		return ERR_CAST(link);
+	s = kstrdup(link->target, GFP_KERNEL);
+	prlfs_link_put(link);
+	return s ? s : ERR_PTR(-ENOMEM);
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static void prlfs_put_link(struct dentry *d, struct nameidata *nd, void *cookie)
 {
@@ -700,24 +1411,32 @@ static void prlfs_put_link(struct dentry *d, struct nameidata *nd, void *cookie)
 static const char *prlfs_get_link(struct dentry *dentry, struct inode *inode,
                                   struct delayed_call *dc)
 {
-	char *symlink;
-	if (!dentry)
-		return ERR_PTR(-ECHILD);
-	symlink = do_read_symlink(dentry);
-	set_delayed_call(dc, kfree_link, symlink);
-	return symlink;
+	struct prlfs_link *link;
+
+	/* RCU walk: the dentry was revalidated, trust the cached target */
+	if (!dentry) {
+		link = prlfs_link_get_cached(inode);
+		if (link == NULL)
+			return ERR_PTR(-ECHILD);
+	} else {
+		link = prlfs_link_get(dentry);
+		if (IS_ERR(link))
+			return ERR_CAST(link);
+	}
+	set_delayed_call(dc, prlfs_link_put, link);
+	return link->target;
 }
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
 static const char *prlfs_follow_link(struct dentry *dentry, void **cookie)
 {
-	char *symlink = do_read_symlink(dentry);
+	char *symlink = prlfs_read_symlink_copy(dentry);
 	*cookie = symlink;
 	return symlink;
 }
 #else
 static void *prlfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
-	char *symlink = do_read_symlink(dentry);
+	char *symlink = prlfs_read_symlink_copy(dentry);
 	nd_set_link(nd, symlink);
 	return symlink;
 }
@@ -728,6 +1447,7 @@ static int prlfs_symlink(struct inode *dir, struct dentry *dentry,
 {
 	PRLFS_STD_INODE_HEAD(dentry)
 	DPRINTK("ENTER symname = '%s'\n", symname);
+	dentry->d_time = 0;
 	ret = host_request_symlink(sb, p, buflen, symname, strlen(symname) + 1);
 	if (ret == 0)
 		ret = prlfs_mknod(dir, dentry, S_IFLNK);
@@ -744,6 +1464,9 @@ struct inode_operations prlfs_file_iops = {
 struct inode_operations prlfs_dir_iops = {
 	.create		= prlfs_create,
 	.lookup		= prlfs_lookup,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	.atomic_open	= prlfs_atomic_open,
+#endif
 	.unlink		= prlfs_unlink,
 	.mkdir		= prlfs_mkdir,
 	.rmdir		= prlfs_rmdir,
@@ -777,28 +1500,29 @@ struct inode_operations prlfs_symlink_iops = {
 #endif
 };
 
-ssize_t prlfs_rw(struct inode *inode, char *buf, size_t size,
-		                loff_t *off, unsigned int rw, int user, int flags);
+ssize_t prlfs_rw(struct inode *inode, struct file *filp, char *buf,
+		 size_t size, loff_t *off, unsigned int rw, int user, int flags);
+#ifdef PRLFS_ITER_IO
+ssize_t prlfs_rw_iter(struct inode *inode, struct file *filp,
+		      struct iov_iter *iter, loff_t *off, unsigned int rw);
+int prlfs_aio_possible(struct kiocb *iocb, struct iov_iter *iter,
+		       unsigned int rw);
+ssize_t prlfs_rw_iter_async(struct kiocb *iocb, struct iov_iter *iter,
+			    unsigned int rw);
+#endif
 
 
+/* file is NULL if the page is not read for an open file */
 int prlfs_readpage(struct file *file, struct page *page) {
 	char *buf;
 	ssize_t ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
-	struct inode *inode = file->f_inode;
-#else
-	struct inode *inode = file->f_dentry->d_inode;
-#endif
-	loff_t off = page->index << PAGE_SHIFT;
-
-	if (!file) {
-		unlock_page(page);
-		return -EINVAL;
-	}
+	struct inode *inode = page->mapping->host;
+	loff_t off = (loff_t)page->index << PAGE_SHIFT;
 
 	if (!PageUptodate(page)) {
 		buf = kmap(page);
-		ret = prlfs_rw(inode, buf, PAGE_SIZE, &off, 0, 0, TG_REQ_PF_CTX);
+		ret = prlfs_rw(inode, file, buf, PAGE_SIZE, &off, 0, 0,
+			       TG_REQ_PF_CTX);
 		if (ret < 0) {
 			kunmap(page);
 			unlock_page(page);
@@ -814,32 +1538,332 @@ int prlfs_readpage(struct file *file, struct page *page) {
 	return 0;
 }
 
+/*
+ * Fill a run of locked page cache pages with consecutive indices by a single
+ * host request. Pages are mapped into one virtually contiguous buffer, so
+ * toolgate sees them as one data buffer. Pages are unlocked and released.
+ */
+static int prlfs_read_pages(struct inode *inode, struct file *file,
+			    struct page **pages, unsigned nr_pages)
+{
+	char *buf;
+	ssize_t ret;
+	unsigned i;
+	size_t size = (size_t)nr_pages << PAGE_SHIFT;
+	loff_t off = page_offset(pages[0]);
+
+	DPRINTK("ENTER index %lu nr_pages %u\n", pages[0]->index, nr_pages);
+	buf = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = prlfs_rw(inode, file, buf, size, &off, 0, 0, TG_REQ_PF_CTX);
+	if (ret >= 0 && ret < size)
+		memset(buf + ret, 0, size - ret);
+	vunmap(buf);
+out:
+	for (i = 0; i < nr_pages; i++) {
+		if (ret >= 0) {
+			flush_dcache_page(pages[i]);
+			SetPageUptodate(pages[i]);
+		}
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	DPRINTK("EXIT returning %lld\n", (long long)ret);
+	return (ret < 0) ? -EIO : 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static void prlfs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct page **pages;
+	struct page *page;
+	unsigned nr_pages = 0, max_pages;
+
+	max_pages = min_t(unsigned, readahead_count(rac), PRLFS_RW_PAGES_MAX);
+	pages = kmalloc(max_pages * sizeof(*pages), GFP_NOFS);
+	/* pages left in rac are unlocked by caller and read by readpage */
+	if (pages == NULL)
+		return;
+
+	while ((page = readahead_page(rac)) != NULL) {
+		pages[nr_pages++] = page;
+		if (nr_pages == max_pages) {
+			prlfs_read_pages(inode, rac->file, pages, nr_pages);
+			nr_pages = 0;
+		}
+	}
+	if (nr_pages)
+		prlfs_read_pages(inode, rac->file, pages, nr_pages);
+	kfree(pages);
+}
+#else
+static int prlfs_readpages(struct file *file, struct address_space *mapping,
+			   struct list_head *page_list, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct page **pages;
+	unsigned nr = 0, max_pages;
+	int ret = 0;
+
+	max_pages = min_t(unsigned, nr_pages, PRLFS_RW_PAGES_MAX);
+	pages = kmalloc(max_pages * sizeof(*pages), GFP_NOFS);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	/* page_list is in reverse order, the first page is at the tail */
+	while (!list_empty(page_list)) {
+		struct page *page = list_entry(page_list->prev, struct page, lru);
+
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+					  mapping_gfp_mask(mapping))) {
+			put_page(page);
+			continue;
+		}
+		if (nr && (nr == max_pages ||
+			   page->index != pages[nr - 1]->index + 1)) {
+			ret = prlfs_read_pages(inode, file, pages, nr);
+			nr = 0;
+		}
+		pages[nr++] = page;
+	}
+	if (nr)
+		ret = prlfs_read_pages(inode, file, pages, nr);
+	kfree(pages);
+	return ret;
+}
+#endif
+
+/* The page lock is all we need, writers of other pages are not held up */
 int prlfs_writepage(struct page *page, struct writeback_control *wbc) {
 	struct inode *inode = page->mapping->host;
-	loff_t i_size = inode->i_size;
+	loff_t i_size = i_size_read(inode);
 	char *buf;
 	ssize_t ret;
 	int rc = 0;
-	loff_t off = page->index << PAGE_SHIFT;
+	loff_t off = (loff_t)page->index << PAGE_SHIFT;
 	loff_t w_remainder = i_size - off;
 
-	prlfs_inode_lock(inode);
+	/* truncated meanwhile */
+	if (w_remainder <= 0)
+		goto out;
+	/* not tagged dirty anymore, i_size is kept until the host has it */
+	atomic_inc(&PRLFS_I(inode)->wr_pending);
 	buf = kmap(page);
-	ret = prlfs_rw(inode, buf,
+	ret = prlfs_rw(inode, NULL, buf,
 		       w_remainder < PAGE_SIZE ? w_remainder : PAGE_SIZE,
 		       &off, 1, 0, TG_REQ_COMMON);
 	kunmap(page);
+	atomic_dec(&PRLFS_I(inode)->wr_pending);
 	if (ret < 0)
 		rc =  -EIO;
-
-	prlfs_inode_unlock(inode);
+out:
 	unlock_page(page);
 	return rc;
 }
 
+#ifdef PRLFS_ITER_IO
+static int prlfs_write_begin(struct file *file, struct address_space *mapping,
+			     loff_t pos, unsigned len, unsigned flags,
+			     struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t i_size = i_size_read(inode);
+	unsigned from = pos & (PAGE_SIZE - 1);
+	struct page *page;
+	loff_t off;
+	char *buf;
+	ssize_t ret;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (page == NULL)
+		return -ENOMEM;
+	*pagep = page;
+	if (PageUptodate(page) || len == PAGE_SIZE)
+		return 0;
+
+	off = page_offset(page);
+	if (off >= i_size || (from == 0 && pos + len >= i_size)) {
+		/* nothing on the host is preserved around the written range */
+		zero_user_segments(page, 0, from, from + len, PAGE_SIZE);
+		return 0;
+	}
+
+	/*
+	 * The host gave a write-only handle: read through another open of
+	 * the inode, -EBADF without any if there is none.
+	 */
+	if (file && !prlfs_fd_allows(PRLFS_F(file)->pfd, O_RDONLY))
+		file = NULL;
+	buf = kmap(page);
+	ret = prlfs_rw(inode, file, buf, PAGE_SIZE, &off, 0, 0, TG_REQ_COMMON);
+	if (ret >= 0 && ret < PAGE_SIZE)
+		memset(buf + ret, 0, PAGE_SIZE - ret);
+	kunmap(page);
+	if (ret < 0) {
+		unlock_page(page);
+		put_page(page);
+		return ret == -EBADF ? ret : -EIO;
+	}
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	return 0;
+}
+
+static int prlfs_write_end(struct file *file, struct address_space *mapping,
+			   loff_t pos, unsigned len, unsigned copied,
+			   struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		/* the rest of the page was not read, make caller retry */
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+	/* dirty first, a revalidation keeps i_size while the page is dirty */
+	set_page_dirty(page);
+	if (pos + copied > i_size_read(inode))
+		prlfs_i_size_extend(inode, pos + copied);
+out:
+	unlock_page(page);
+	put_page(page);
+	return copied;
+}
+#endif
+
+#ifdef PRLFS_ITER_IO
+/*
+ * O_DIRECT: every iovec segment is pinned by toolgate and handed to the
+ * host as is. The generic code flushes and invalidates the page cache
+ * around us and takes care of ki_pos and i_size, except for aio which
+ * is completed by prlfs_rw_iter_async().
+ */
+static ssize_t prlfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct dentry *dentry = FILE_DENTRY(iocb->ki_filp);
+	loff_t pos = iocb->ki_pos;
+	unsigned int rw = (iov_iter_rw(iter) == WRITE) ? 1 : 0;
+	ssize_t ret;
+
+	if (prlfs_aio_possible(iocb, iter, rw))
+		return prlfs_rw_iter_async(iocb, iter, rw);
+	ret = prlfs_rw_iter(dentry->d_inode, iocb->ki_filp, iter, &pos, rw);
+	if (rw)
+		dentry->d_time = 0;
+	return ret;
+}
+#endif
+
+/* run of contiguous dirty pages collected by prlfs_writepages() */
+struct prlfs_wb_batch {
+	struct inode *inode;
+	unsigned nr_pages;
+	struct page *pages[PRLFS_RW_PAGES_MAX];
+};
+
+static void prlfs_write_pages(struct prlfs_wb_batch *wb)
+{
+	struct inode *inode = wb->inode;
+	loff_t off = page_offset(wb->pages[0]);
+	loff_t i_size = i_size_read(inode);
+	size_t size = (size_t)wb->nr_pages << PAGE_SHIFT;
+	ssize_t ret = 0;
+	char *buf;
+	unsigned i;
+
+	DPRINTK("ENTER index %lu nr_pages %u\n", wb->pages[0]->index,
+		wb->nr_pages);
+	if (off + size > i_size)
+		size = (i_size > off) ? i_size - off : 0;
+	if (size == 0)
+		goto out;
+
+	buf = vmap(wb->pages, wb->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = prlfs_rw(inode, NULL, buf, size, &off, 1, 0, TG_REQ_COMMON);
+	vunmap(buf);
+out:
+	if (ret < 0)
+		mapping_set_error(inode->i_mapping, -EIO);
+	for (i = 0; i < wb->nr_pages; i++) {
+		if (ret < 0)
+			SetPageError(wb->pages[i]);
+		end_page_writeback(wb->pages[i]);
+		put_page(wb->pages[i]);
+	}
+	wb->nr_pages = 0;
+	DPRINTK("EXIT ret %lld\n", (long long)ret);
+}
+
+static int prlfs_writepages_fill(struct page *page,
+				 struct writeback_control *wbc, void *data)
+{
+	struct prlfs_wb_batch *wb = data;
+
+	set_page_writeback(page);
+	get_page(page);
+	unlock_page(page);
+
+	/* page lock is dropped, now the previous run may be sent to host */
+	if (wb->nr_pages && (wb->nr_pages == PRLFS_RW_PAGES_MAX ||
+	    page->index != wb->pages[wb->nr_pages - 1]->index + 1))
+		prlfs_write_pages(wb);
+	wb->pages[wb->nr_pages++] = page;
+	return 0;
+}
+
+/*
+ * As in prlfs_writepage() the inode lock is not taken here: the host write
+ * does not need it, and holding it with pages under writeback would deadlock
+ * against truncate which waits for writeback with the inode lock held.
+ */
+static int prlfs_writepages(struct address_space *mapping,
+			    struct writeback_control *wbc)
+{
+	struct prlfs_wb_batch *wb;
+	int ret;
+
+	wb = kmalloc(sizeof(*wb), GFP_NOFS);
+	if (wb == NULL)
+		return generic_writepages(mapping, wbc);
+
+	wb->inode = mapping->host;
+	wb->nr_pages = 0;
+	/* pages are collected cleaned before they are under writeback */
+	atomic_inc(&PRLFS_I(wb->inode)->wr_pending);
+	ret = write_cache_pages(mapping, wbc, prlfs_writepages_fill, wb);
+	if (wb->nr_pages)
+		prlfs_write_pages(wb);
+	atomic_dec(&PRLFS_I(wb->inode)->wr_pending);
+	kfree(wb);
+	return ret;
+}
+
 static const struct address_space_operations prlfs_aops = {
 	.readpage		= prlfs_readpage,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	.readahead		= prlfs_readahead,
+#else
+	.readpages		= prlfs_readpages,
+#endif
 	.writepage		= prlfs_writepage,
+	.writepages		= prlfs_writepages,
+#ifdef PRLFS_ITER_IO
+	.write_begin		= prlfs_write_begin,
+	.write_end		= prlfs_write_end,
+	.direct_IO		= prlfs_direct_IO,
+#endif
 };
 
 
@@ -869,6 +1893,45 @@ struct inode_operations prlfs_root_iops = {
 #define prlfs_current_time(inode) CURRENT_TIME
 #endif
 
+static void prlfs_init_inode(struct inode *inode,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+			umode_t mode
+#else
+			int mode
+#endif
+			)
+{
+	struct super_block *sb = inode->i_sb;
+
+	inode->i_mode = mode;
+	inode->i_blocks = 0;
+	inode->i_ctime = prlfs_current_time(inode);
+	inode->i_atime = inode->i_mtime = inode->i_ctime;
+	if (PRLFS_SB(sb)->share) {
+		inode->i_uid = current->cred->uid;
+		inode->i_gid = current->cred->gid;
+	} else {
+		inode->i_uid = PRLFS_SB(sb)->uid;
+		inode->i_gid = PRLFS_SB(sb)->gid;
+	}
+	inode->i_mapping->a_ops = &prlfs_aops;
+
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		inode->i_op = &prlfs_dir_iops;
+		inode->i_fop = &prlfs_dir_fops;
+		break;
+	case 0: case S_IFREG:
+		inode->i_op = &prlfs_file_iops;
+		inode->i_fop =  &prlfs_file_fops;
+		break;
+	case S_IFLNK:
+		inode->i_op = &prlfs_symlink_iops;
+		inode->i_fop = &prlfs_file_fops;
+		break;
+	}
+}
+
 static struct inode *prlfs_get_inode(struct super_block *sb,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
 			umode_t mode
@@ -878,57 +1941,83 @@ static struct inode *prlfs_get_inode(struct super_block *sb,
 			)
 {
 	struct inode * inode;
-	struct prlfs_fd* pfd;
 
 	DPRINTK("ENTER\n");
 	inode = new_inode(sb);
 	if (inode) {
-		inode->i_mode = mode;
-		inode->i_blocks = 0;
-		inode->i_ctime = prlfs_current_time(inode);
-		inode->i_atime = inode->i_mtime = inode->i_ctime;
-		if (PRLFS_SB(sb)->share) {
-			inode->i_uid = current->cred->uid;
-			inode->i_gid = current->cred->gid;
-		} else {
-			inode->i_uid = PRLFS_SB(sb)->uid;
-			inode->i_gid = PRLFS_SB(sb)->gid;
-		}
-		inode->i_mapping->a_ops = &prlfs_aops;
-
-		pfd = kmalloc(sizeof(struct prlfs_fd), GFP_KERNEL);
-		if (pfd != NULL)
-			memset(pfd, 0, sizeof(struct prlfs_fd));
-		else
-			pfd = ERR_PTR(-ENOMEM);
-		inode_set_pfd(inode, pfd);
-
+		prlfs_init_inode(inode, mode);
 		SET_INODE_INO(inode, get_next_ino());
-		switch (mode & S_IFMT) {
-		case S_IFDIR:
-			inode->i_op = &prlfs_dir_iops;
-			inode->i_fop = &prlfs_dir_fops;
-			break;
-		case 0: case S_IFREG:
+		if (S_ISREG(mode) || !(mode & S_IFMT))
 			prlfs_hlist_init(inode);
-			inode->i_op = &prlfs_file_iops;
-			inode->i_fop =  &prlfs_file_fops;
-			break;
-		case S_IFLNK:
-			inode->i_op = &prlfs_symlink_iops;
-			inode->i_fop = &prlfs_file_fops;
-			break;
-		}
 	}
 	DPRINTK("EXIT returning %p\n", inode);
 	return inode;
 }
 
+static int prlfs_inode_test(struct inode *inode, void *data)
+{
+	return PRLFS_I(inode)->host_ino == *(unsigned long long *)data;
+}
+
+static int prlfs_inode_set(struct inode *inode, void *data)
+{
+	PRLFS_I(inode)->host_ino = *(unsigned long long *)data;
+	SET_INODE_INO(inode, PRLFS_I(inode)->host_ino);
+	return 0;
+}
+
+/*
+ * Returns an inode with the attributes of the host file. With host inode
+ * numbers all the dentries of a host file share a single inode, and its
+ * page cache outlives them in the inode cache.
+ */
+static struct inode *prlfs_attr_get_inode(struct super_block *sb,
+					  struct prlfs_attr *attr)
+{
+	struct inode *inode;
+	int retry = 1;
+
+	if (!PRLFS_SB(sb)->host_inodes || !(attr->valid & _PATTR2_INO) ||
+	    attr->ino == 0)
+		goto out_new;
+again:
+	inode = iget5_locked(sb, (unsigned long)attr->ino, prlfs_inode_test,
+			     prlfs_inode_set, &attr->ino);
+	if (inode == NULL)
+		return NULL;
+	if (inode->i_state & I_NEW) {
+		prlfs_init_inode(inode, attr->mode);
+		prlfs_change_attributes(inode, attr);
+		unlock_new_inode(inode);
+		return inode;
+	}
+	if (!((inode->i_mode ^ attr->mode) & S_IFMT)) {
+		/* pages cached before the file changed on the host are stale */
+		if (S_ISREG(inode->i_mode) &&
+		    (((attr->valid & _PATTR_MTIME) &&
+		      inode->i_mtime.tv_sec != attr->mtime) ||
+		     ((attr->valid & _PATTR_SIZE) &&
+		      i_size_read(inode) != attr->size)))
+			invalidate_mapping_pages(inode->i_mapping, 0, -1);
+		prlfs_change_attributes(inode, attr);
+		return inode;
+	}
+	/* the host reused the number for a file of another type */
+	prlfs_inode_gone(inode);
+	iput(inode);
+	if (retry--)
+		goto again;
+out_new:
+	inode = prlfs_get_inode(sb, attr->mode);
+	if (inode)
+		prlfs_change_attributes(inode, attr);
+	return inode;
+}
+
 void prlfs_read_inode(struct inode *inode)
 {
 	ino_t ino = inode->i_ino;
 	struct super_block *sb = inode->i_sb;
-	struct prlfs_fd *pfd;
 
 	inode->i_mode = S_IFDIR | S_IRUGO | S_IXUGO | S_IWUSR;
 	inode->i_ctime = prlfs_current_time(inode);
@@ -941,15 +2030,6 @@ void prlfs_read_inode(struct inode *inode)
 		inode->i_gid = PRLFS_SB(sb)->gid;
 	}
 
-	if (!inode_get_pfd(inode)) {
-		pfd = kmalloc(sizeof(struct prlfs_fd), GFP_KERNEL);
-		if (pfd != NULL)
-			memset(pfd, 0, sizeof(struct prlfs_fd));
-		else
-			pfd = ERR_PTR(-ENOMEM);
-		inode_set_pfd(inode, pfd);
-	}
-
 	if (ino == PRLFS_ROOT_INO) {
 		inode->i_op = &prlfs_dir_iops;
 		inode->i_fop = &prlfs_dir_fops;
@@ -195,7 +195,7 @@ int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 	int ibc = 0;
 	TG_BUFFER *tgb = (TG_BUFFER *)&Req.i;
 
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
 	if (!pfd)
 		return -ENOMEM;
 	prlfs_file_info_to_desc(pfd, pfi);
@@ -217,10 +217,198 @@ int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 		ret = -TG_ERR(Req.Req.Status);
 
 	prlfs_file_desc_to_info(pfi, pfd);
-	kfree(pfd);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
 	return ret;
 }
 
+/*
+ * Sends nops operations in one TG_REQUEST_FS_L_COMPOUND. The buffers they
+ * refer to are bd[], numbered from 1. err[i] gets the result of ops[i],
+ * -EAGAIN if the host did not run it.
+ */
+int host_request_compound(struct super_block *sb, struct prlfs_compound_op *ops,
+			  int nops, struct buffer_descriptor *bd, int nbd,
+			  int *err)
+{
+	int i, ret;
+	TG_REQ_DESC sdesc;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer[1 + 2 * PRLFS_COMPOUND_MAX_OPS];
+	} Req;
+
+	if (nops > PRLFS_COMPOUND_MAX_OPS || nbd > 2 * PRLFS_COMPOUND_MAX_OPS)
+		return -EINVAL;
+	for (i = 0; i < nops; i++)
+		ops[i].status = TG_STATUS_PENDING;
+
+	memset(&Req, 0, sizeof(Req));
+	init_tg_request(&Req.Req, TG_REQUEST_FS_L_COMPOUND, 0, 1 + nbd);
+	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
+	init_tg_buffer(&sdesc, 0, (void *)ops, nops * sizeof(*ops), 1, 0);
+	for (i = 0; i < nbd; i++)
+		init_tg_buffer(&sdesc, i + 1, bd[i].buf, bd[i].len,
+			       bd[i].write, bd[i].user);
+	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
+	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS))
+		ret = -TG_ERR(Req.Req.Status);
+	for (i = 0; i < nops; i++)
+		err[i] = ret ? ret : -TG_ERR(ops[i].status);
+	return ret;
+}
+
+/*
+ * host_request_open() that also gets the attributes of the opened file,
+ * in the same request if the host can. attr->valid is 0 if it could not.
+ */
+int host_request_open_attr(struct super_block *sb, struct prlfs_file_info *pfi,
+			   const char *p, int plen, struct prlfs_attr *attr)
+{
+	int ret, err[2];
+	struct prlfs_file_desc *pfd;
+	struct prlfs_compound_op ops[2];
+	struct buffer_descriptor bd[3];
+	unsigned flags = 0;
+
+	attr->valid = 0;
+	if (!PRLFS_SB(sb)->compound)
+		return host_request_open(sb, pfi, p, plen);
+
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
+	if (!pfd)
+		return -ENOMEM;
+	prlfs_file_info_to_desc(pfd, pfi);
+
+	if (PRLFS_SB(sb)->host_inodes)
+		flags |= PRLFS_SFF_HOST_INODES;
+	memset(ops, 0, sizeof(ops));
+	ops[0].op = TG_REQUEST_FS_L_OPEN;
+	ops[0].flags = flags;
+	ops[0].path = 1;
+	ops[0].data = 2;
+	ops[1].op = TG_REQUEST_FS_L_ATTR;
+	ops[1].flags = flags;
+	ops[1].path = 1;
+	ops[1].data = 3;
+	init_buffer_descriptor(&bd[0], (void *)p, plen, 0, 0);
+	init_buffer_descriptor(&bd[1], pfd, PFD_LEN, 1, 0);
+	init_buffer_descriptor(&bd[2], attr, PATTR_STRUCT_SIZE, 1, 0);
+	ret = host_request_compound(sb, ops, 2, bd, 3, err);
+	if (ret == 0)
+		ret = err[0];
+	/* the open is what counts, the caller asks for attributes itself */
+	if (err[1] < 0)
+		attr->valid = 0;
+
+	prlfs_file_desc_to_info(pfi, pfd);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
+	return ret;
+}
+
+/* Makes the host write what it got through the handle to the disk */
+int host_request_flush(struct super_block *sb, struct prlfs_file_info *pfi)
+{
+	int ret;
+	TG_REQ_DESC sdesc;
+	struct prlfs_file_desc *pfd;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer;
+	} Req;
+
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
+	if (!pfd)
+		return -ENOMEM;
+	prlfs_file_info_to_desc(pfd, pfi);
+	memset(&Req, 0, sizeof(Req));
+	init_tg_request(&Req.Req, TG_REQUEST_FS_FLUSHBUFFERS, 0, 1);
+	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer);
+	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 0, 0);
+	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
+	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS))
+		ret = -TG_ERR(Req.Req.Status);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
+	return ret;
+}
+
+int host_request_copy(struct super_block *sb, struct prlfs_file_info *src,
+		      struct prlfs_file_info *dst, struct prlfs_copy_range *cr)
+{
+	int ret;
+	TG_REQ_DESC sdesc;
+	struct prlfs_file_desc *spfd, *dpfd;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer[3];
+	} Req;
+
+	spfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
+	if (!spfd)
+		return -ENOMEM;
+	dpfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
+	if (!dpfd) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	prlfs_file_info_to_desc(spfd, src);
+	prlfs_file_info_to_desc(dpfd, dst);
+	memset(&Req, 0, sizeof(Req));
+	init_tg_request(&Req.Req, TG_REQUEST_FS_L_COPY, 0, 3);
+	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
+	init_tg_buffer(&sdesc, 0, (void *)spfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&sdesc, 1, (void *)dpfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&sdesc, 2, (void *)cr, sizeof(*cr), 1, 0);
+	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
+	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS))
+		ret = -TG_ERR(Req.Req.Status);
+	kmem_cache_free(prlfs_file_desc_cachep, dpfd);
+out_free:
+	kmem_cache_free(prlfs_file_desc_cachep, spfd);
+	return ret;
+}
+
+/* A file descriptor and a request specific structure the host may update */
+static int host_request_fd_op(struct super_block *sb, unsigned request,
+			      struct prlfs_file_info *pfi, void *data, int size)
+{
+	int ret;
+	TG_REQ_DESC sdesc;
+	struct prlfs_file_desc *pfd;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer[2];
+	} Req;
+
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
+	if (!pfd)
+		return -ENOMEM;
+	prlfs_file_info_to_desc(pfd, pfi);
+	memset(&Req, 0, sizeof(Req));
+	init_tg_request(&Req.Req, request, 0, 2);
+	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
+	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&sdesc, 1, data, size, 1, 0);
+	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
+	if ((ret == 0) && (Req.Req.Status != TG_STATUS_SUCCESS))
+		ret = -TG_ERR(Req.Req.Status);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
+	return ret;
+}
+
+int host_request_fallocate(struct super_block *sb, struct prlfs_file_info *pfi,
+			   struct prlfs_fallocate *fa)
+{
+	return host_request_fd_op(sb, TG_REQUEST_FS_L_FALLOCATE, pfi,
+				  fa, sizeof(*fa));
+}
+
+int host_request_seek(struct super_block *sb, struct prlfs_file_info *pfi,
+		      struct prlfs_seek *ps)
+{
+	return host_request_fd_op(sb, TG_REQUEST_FS_L_SEEK, pfi,
+				  ps, sizeof(*ps));
+}
+
 int host_request_release(struct super_block *sb, struct prlfs_file_info *pfi)
 {
 	int ret;
@@ -231,7 +419,7 @@ int host_request_release(struct super_block *sb, struct prlfs_file_info *pfi)
 		TG_REQUEST Req;
 		TG_BUFFER Buffer;
 	} Req;
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
 	if (!pfd)
 		return -ENOMEM;
 retry:
@@ -250,43 +438,73 @@ retry:
 			ret = -TG_ERR(Req.Req.Status);
 		}
 	}
-	kfree(pfd);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
 	return ret;
 }
 
-int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
-			 void *buf, int *buflen)
+static int do_host_request_readdir(struct super_block *sb,
+				   struct prlfs_file_info *pfi,
+				   void *buf, int *buflen, unsigned request)
 {
 	int ret;
 	TG_REQ_DESC sdesc;
 	struct prlfs_file_desc *pfd;
 	struct {
 		TG_REQUEST Req;
+		struct {
+			unsigned flags;
+		} i;
 		TG_BUFFER Buffer[2];
 	} Req;
+	void *idata = NULL;
+	int ibc = 0;
+	TG_BUFFER *tgb = (TG_BUFFER *)&Req.i;
 
 
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
 	if (!pfd)
 		return -ENOMEM;
 	prlfs_file_info_to_desc(pfd, pfi);
 	memset(&Req, 0, sizeof(Req));
-	init_tg_request(&Req.Req, TG_REQUEST_FS_L_READDIR, 0, 2);
-	init_req_desc(&sdesc, &Req.Req, NULL, &Req.Buffer[0]);
+	if (request == TG_REQUEST_FS_L_READDIR && PRLFS_SB(sb)->dirent_ino) {
+		/* ask for prlfs_dirent_ino entries */
+		idata = &Req.i;
+		ibc = sizeof(Req.i);
+		tgb = &Req.Buffer[0];
+		Req.i.flags |= PRLFS_SFF_DIRENT_INO;
+	}
+	init_tg_request(&Req.Req, request, ibc, 2);
+	init_req_desc(&sdesc, &Req.Req, idata, tgb);
 	init_tg_buffer(&sdesc, 0, (void *)pfd, PFD_LEN, 1, 0);
 	init_tg_buffer(&sdesc, 1, buf, *buflen, 1, 0);
 	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
 	if (ret == 0) {
 		if (Req.Req.Status == TG_STATUS_SUCCESS)
-			*buflen = Req.Buffer[1].ByteCount;
+			*buflen = tgb[1].ByteCount;
 		else
 			ret = -TG_ERR(Req.Req.Status);
 	}
 	prlfs_file_desc_to_info(pfi, pfd);
-	kfree(pfd);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
 	return ret;
 }
 
+int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
+			 void *buf, int *buflen)
+{
+	return do_host_request_readdir(sb, pfi, buf, buflen,
+				       TG_REQUEST_FS_L_READDIR);
+}
+
+/* Same as host_request_readdir() but fills prlfs_dirent_plus entries */
+int host_request_readdirplus(struct super_block *sb,
+			     struct prlfs_file_info *pfi,
+			     void *buf, int *buflen)
+{
+	return do_host_request_readdir(sb, pfi, buf, buflen,
+				       TG_REQUEST_FS_L_READDIRPLUS);
+}
+
 int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 						 struct buffer_descriptor *bd)
 {
@@ -298,7 +516,7 @@ int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 		TG_BUFFER Buffer[2];
 	} Req;
 
-	pfd = kmalloc(sizeof(struct prlfs_file_desc), GFP_KERNEL);
+	pfd = kmem_cache_alloc(prlfs_file_desc_cachep, GFP_KERNEL);
 	if (!pfd)
 		return -ENOMEM;
 	prlfs_file_info_to_desc(pfd, pfi);
@@ -315,7 +533,60 @@ int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 		else
 			ret = -TG_ERR(Req.Req.Status);
 	}
-	kfree(pfd);
+	kmem_cache_free(prlfs_file_desc_cachep, pfd);
+	return ret;
+}
+
+struct host_rw_async_req {
+	TG_REQ_DESC sdesc;
+	struct {
+		TG_REQUEST Req;
+		TG_BUFFER Buffer[2];
+	} Req;
+	struct prlfs_file_desc pfd;
+	void (*done)(void *data, ssize_t ret);
+	void *data;
+};
+
+static void host_request_rw_async_done(void *data)
+{
+	struct host_rw_async_req *ar = data;
+	ssize_t ret;
+
+	if (ar->Req.Req.Status == TG_STATUS_SUCCESS)
+		ret = ar->Req.Buffer[1].ByteCount;
+	else
+		ret = -TG_ERR(ar->Req.Req.Status);
+	ar->done(ar->data, ret);
+	kfree(ar);
+}
+
+/*
+ * Same as host_request_rw() but does not wait for the host: @done gets
+ * the transferred length or an error from the toolgate completion path.
+ */
+int host_request_rw_async(struct super_block *sb, struct prlfs_file_info *pfi,
+			  struct buffer_descriptor *bd,
+			  void (*done)(void *data, ssize_t ret), void *data)
+{
+	struct host_rw_async_req *ar;
+	int ret;
+
+	ar = kzalloc(sizeof(struct host_rw_async_req), GFP_KERNEL);
+	if (!ar)
+		return -ENOMEM;
+	prlfs_file_info_to_desc(&ar->pfd, pfi);
+	init_tg_request(&ar->Req.Req, TG_REQUEST_FS_L_RW, 0, 2);
+	init_req_desc(&ar->sdesc, &ar->Req.Req, NULL, &ar->Req.Buffer[0]);
+	init_tg_buffer(&ar->sdesc, 0, (void *)&ar->pfd, PFD_LEN, 0, 0);
+	init_tg_buffer(&ar->sdesc, 1, bd->buf, bd->len, bd->write, bd->user);
+	ar->sdesc.flags = bd->flags;
+	ar->done = done;
+	ar->data = data;
+	ret = call_tg_async_start_cb(PRLTG_SB(sb), &ar->sdesc,
+				     host_request_rw_async_done, ar);
+	if (ret < 0)
+		kfree(ar);
 	return ret;
 }
 
@@ -419,6 +690,35 @@ int host_request_statfs(struct super_block *sb, long *bsize, compat_statfs_block
 	return ret;
 }
 
+/*
+ * Waits on the host until something changes in the shared folder and
+ * fills buf with prlfs_notify_event records. Interrupted by a signal.
+ */
+int host_request_notify(struct super_block *sb, void *buf, int *buflen)
+{
+	int ret;
+	TG_REQ_DESC sdesc;
+	struct {
+		TG_REQUEST Req;
+		unsigned sfid;
+		TG_BUFFER Buffer;
+	} Req;
+
+	memset(&Req, 0, sizeof(Req));
+	init_tg_request(&Req.Req, TG_REQUEST_FS_L_NOTIFY, sizeof(Req.sfid), 1);
+	Req.sfid = PRLFS_SB(sb)->sfid;
+	init_req_desc(&sdesc, &Req.Req, &Req.sfid, &Req.Buffer);
+	init_tg_buffer(&sdesc, 0, buf, *buflen, 1, 0);
+	ret = call_tg_sync(PRLTG_SB(sb), &sdesc);
+	if (ret == 0) {
+		if (Req.Req.Status == TG_STATUS_SUCCESS)
+			*buflen = Req.Buffer.ByteCount;
+		else
+			ret = -TG_ERR(Req.Req.Status);
+	}
+	return ret;
+}
+
 int host_request_readlink(struct super_block *sb, void *src_path, int src_len,
                           void *tgt_path, int tgt_len)
 {
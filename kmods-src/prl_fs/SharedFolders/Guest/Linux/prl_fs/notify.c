@@ -0,0 +1,163 @@
+/*
+ *	prlfs/notify.c
+ *
+ *	Copyright (C) 1999-2016 Parallels International GmbH
+ *
+ *	Parallels Linux shared folders filesystem
+ *
+ *	Host change notifications: a per-mount thread keeps a
+ *	TG_REQUEST_FS_L_NOTIFY request pending on the host and, when it
+ *	completes, expires only the dentries the host reported as changed.
+ *	While it runs dentries may stay cached for PRLFS_NOTIFY_TTL.
+ */
+
+#include <linux/kthread.h>
+#include <linux/dcache.h>
+#include "prlfs.h"
+
+/* Expire the cached attributes of the dentry at host path relative to root */
+static void prlfs_notify_path(struct super_block *sb, char *path, int len)
+{
+	struct dentry *dentry, *child, *parent;
+	struct inode *inode;
+	struct qstr name;
+	char *p = path, *end = path + len, *sep;
+
+	dentry = dget(sb->s_root);
+	while (p < end) {
+		sep = memchr(p, '/', end - p);
+		if (sep == NULL)
+			sep = end;
+		if (sep == p) {
+			p++;
+			continue;
+		}
+		name.name = p;
+		name.len = sep - p;
+		child = d_hash_and_lookup(dentry, &name);
+		if (IS_ERR_OR_NULL(child))
+			break;
+		dput(dentry);
+		dentry = child;
+		p = sep + 1;
+	}
+	/*
+	 * Not in the dcache: the deepest cached ancestor may still be
+	 * listed or stat'ed, the dentry itself is looked up on demand.
+	 */
+	dentry->d_time = 0;
+	if (p >= end) {
+		parent = dget_parent(dentry);
+		parent->d_time = 0;
+		dput(parent);
+		inode = dentry->d_inode;
+		if (inode && S_ISREG(inode->i_mode))
+			invalidate_mapping_pages(inode->i_mapping, 0, -1);
+	}
+	dput(dentry);
+}
+
+static void prlfs_notify_process(struct super_block *sb, char *buf, int len)
+{
+	struct prlfs_notify_event *ev;
+	int rec_len;
+
+	while (len >= (int)sizeof(*ev)) {
+		ev = (struct prlfs_notify_event *)buf;
+		rec_len = PRLFS_NOTIFY_REC_LEN(ev->path_len);
+		if (rec_len > len)
+			break;
+		DPRINTK("action %u %.*s\n", ev->action, ev->path_len, ev->path);
+		if (ev->action == PRLFS_NOTIFY_OVERFLOW)
+			PRLFS_SB(sb)->inval_time = jiffies;
+		else
+			prlfs_notify_path(sb, ev->path, ev->path_len);
+		buf += rec_len;
+		len -= rec_len;
+	}
+}
+
+static int prlfs_notify_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct prlfs_sb_info *sbi = PRLFS_SB(sb);
+	void *buf;
+	int ret, len;
+
+	DPRINTK("ENTER\n");
+	/* prlfs_notify_stop() kills the pending host request by a signal */
+	allow_signal(SIGKILL);
+	buf = kmalloc(PRLFS_NOTIFY_BUFSIZE, GFP_KERNEL);
+	if (buf == NULL)
+		goto out_idle;
+
+	while (!kthread_should_stop()) {
+		/* a SIGKILL we flushed below may have been the stop request */
+		smp_rmb();
+		if (sbi->notify_stopping)
+			break;
+		len = PRLFS_NOTIFY_BUFSIZE;
+		ret = host_request_notify(sb, buf, &len);
+		if (kthread_should_stop() || sbi->notify_stopping)
+			break;
+		if (ret == -ERESTARTSYS) {
+			if (signal_pending(current)) {
+				/* a stray one, the flag is checked again above */
+				flush_signals(current);
+				continue;
+			}
+			/* cancelled by suspend, whatever happened meanwhile is lost */
+			sbi->inval_time = jiffies;
+			schedule_timeout_interruptible(HZ);
+			continue;
+		}
+		if (ret < 0) {
+			printk(KERN_WARNING PFX "change notifications for %s "
+			       "stopped: %d\n", sbi->name, ret);
+			break;
+		}
+		prlfs_notify_process(sb, buf, len);
+	}
+	kfree(buf);
+out_idle:
+	/* back to the short ttl, nothing tells us about changes anymore */
+	sbi->notify = 0;
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	DPRINTK("EXIT\n");
+	return 0;
+}
+
+void prlfs_notify_start(struct super_block *sb)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(sb);
+	struct task_struct *task;
+
+	sbi->inval_time = jiffies;
+	task = kthread_run(prlfs_notify_thread, sb, "prlfs_notify/%u",
+			   sbi->sfid);
+	if (IS_ERR(task))
+		return;
+	sbi->notify_task = task;
+	sbi->notify = 1;
+}
+
+/* Must be called before the dcache of sb is torn down */
+void prlfs_notify_stop(struct super_block *sb)
+{
+	struct prlfs_sb_info *sbi = PRLFS_SB(sb);
+
+	if (sbi == NULL || sbi->notify_task == NULL)
+		return;
+	sbi->notify_stopping = 1;
+	/* seen by the thread before the signal is */
+	smp_wmb();
+	send_sig(SIGKILL, sbi->notify_task, 1);
+	kthread_stop(sbi->notify_task);
+	sbi->notify_task = NULL;
+	sbi->notify = 0;
+}
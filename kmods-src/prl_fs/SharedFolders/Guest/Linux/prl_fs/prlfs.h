@@ -16,6 +16,7 @@
 #include <linux/types.h>
 #include <linux/stat.h>
 #include <linux/fcntl.h>
+#include <linux/slab.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
 #include <linux/backing-dev-defs.h>
 #else
@@ -107,17 +108,49 @@ typedef gid_t kgid_t;
 #define prlfs_bdi_destroy(bdi) bdi_destroy(bdi)
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+#define PRLFS_ITER_IO
+#endif
+
+/* "cache=" mount option values */
+enum {
+	PRLFS_CACHE_BUFFERED = 0,	/* write(2) goes through the page cache */
+	PRLFS_CACHE_NONE,		/* write(2) goes straight to the host */
+	PRLFS_CACHE_WRITEBACK,		/* buffered without MS_SYNCHRONOUS */
+};
+
 struct prlfs_sb_info {
 	struct backing_dev_info bdi;
 	struct	pci_dev *pdev;
 	unsigned sfid;
-	unsigned ttl;
+	/* bounds of the per-inode attribute cache lifetime, in jiffies */
+	unsigned attr_min;
+	unsigned attr_max;
+	unsigned dir_min;
+	unsigned dir_max;
+	unsigned neg_ttl;	/* ttl of negative dentries */
+	unsigned rdsize;	/* readdir buffer size */
 	kuid_t uid;
 	kgid_t gid;
 	int readonly;
 	int share;
 	int plain;
 	int host_inodes;
+	int readdirplus;	/* host supports TG_REQUEST_FS_L_READDIRPLUS */
+	int dirent_ino;		/* readdir entries carry host inode numbers */
+	int compound;		/* host supports TG_REQUEST_FS_L_COMPOUND */
+	int flush;		/* host supports TG_REQUEST_FS_FLUSHBUFFERS */
+	int copy;		/* host supports TG_REQUEST_FS_L_COPY */
+	int fallocate;		/* host supports TG_REQUEST_FS_L_FALLOCATE */
+	int seek;		/* host supports TG_REQUEST_FS_L_SEEK */
+	atomic_t dirent_next_ino; /* for entries without them */
+	int cache;
+	/* host change notifications, see notify.c */
+	struct task_struct *notify_task;
+	int notify;		/* the listener is running */
+	int notify_stopping;	/* set by prlfs_notify_stop() before SIGKILL */
+	unsigned long inval_time; /* jiffies of the last lost notification */
+	struct prlfs_dentry_info *root_info;
 	char nls[LOCALE_NAME_LEN];
 	char name[NAME_MAX];
 };
@@ -127,20 +160,98 @@ struct prlfs_fd {
 	unsigned int		sfid;
 	unsigned long long	f_counter;
 	unsigned int		f_flags;
+	int			idle;	/* unused but kept open, see handle.c */
+	int			pin;	/* requests without a file, see prlfs_fd_get() */
+	/* idle since prlfs_create_open(), its attributes are fresh */
+	int			created;
+	/* host file when the handle went idle, checked before it is reused */
+	unsigned long long	idle_mtime;
+	loff_t			idle_size;
 };
 
-#define inode_get_pfd(inode)  ((struct prlfs_fd *)(inode)->i_private)
-static inline void inode_set_pfd(struct inode *inode, struct prlfs_fd *pfd)
+#define prlfs_fd_is_open(pfd) ((pfd)->f_counter || (pfd)->idle)
+/*
+ * Index into pfd[] for the open flags. Access mode 3 (ioctl only) is
+ * checked for read and write by the VFS and gets a read-write handle.
+ */
+static inline unsigned int prlfs_acc_mode(unsigned int flags)
 {
-	inode->i_private = (void *)pfd;
+	unsigned int acc = flags & O_ACCMODE;
+
+	return acc == O_ACCMODE ? O_RDWR : acc;
 }
 
-static inline void init_pfi(struct prlfs_file_info *pfi, struct inode *inode, 
+/* may the handle serve reads (O_RDONLY) or writes (O_WRONLY) */
+#define prlfs_fd_allows(pfd, acc) \
+	((pfd)->f_flags == O_RDWR || (pfd)->f_flags == (acc))
+
+/* symlink target, freed after an RCU grace period by the last reference */
+struct prlfs_link {
+	atomic_t		count;
+	struct rcu_head		rcu;
+	char			target[0];
+};
+
+/* prl_fs inode, allocated from prlfs_inode_cachep by prlfs_alloc_inode() */
+struct prlfs_inode_info {
+	/* host handles indexed by access mode: O_RDONLY, O_WRONLY, O_RDWR */
+	struct prlfs_fd		pfd[3];
+	struct mutex		open_lock;	/* protects pfd[] */
+	/* f_counter, idle and pin of pfd[] change under fd_lock too */
+	spinlock_t		fd_lock;
+	wait_queue_head_t	fd_wait;	/* for pins to be dropped */
+	/*
+	 * Byte ranges of cache=none writes in flight to the host, they run
+	 * under the shared inode lock. wr_lock also serializes i_size updates
+	 * made without the exclusive inode lock.
+	 */
+	spinlock_t		wr_lock;
+	struct list_head	wr_ranges;
+	wait_queue_head_t	wr_wait;
+	/* host writes and writeback in flight, the host size may lag */
+	atomic_t		wr_pending;
+	unsigned long long	host_ino;	/* iget5_locked() key, or 0 */
+	/* how long attributes from the host are trusted, see prlfs_attr_timeo() */
+	unsigned long		attr_timeo;
+	/* host file at the last close, see prlfs_cto_save() */
+	unsigned long long	cto_mtime;
+	loff_t			cto_size;
+	int			cto_valid;
+	int			cto_written;	/* host file written since */
+	/* on the idle handle LRU since idle_since, see prlfs_idle_add() */
+	struct list_head	idle_lru;
+	unsigned long		idle_since;
+	struct prlfs_link	*link;		/* cached symlink target or NULL */
+	struct inode		vfs_inode;
+};
+
+static inline struct prlfs_inode_info *PRLFS_I(struct inode *inode)
+{
+	return container_of(inode, struct prlfs_inode_info, vfs_inode);
+}
+
+/* file->private_data */
+struct prlfs_file {
+	struct prlfs_fd		*pfd;	/* host handle of this open */
+	void			*rdbuf;	/* readdir buffer, directories only */
+	int			rdsize;	/* rdbuf size in use, if not the mount's */
+};
+
+#define PRLFS_F(filp) ((struct prlfs_file *)(filp)->private_data)
+
+/* slab caches for objects allocated on every host request */
+extern struct kmem_cache *prlfs_inode_cachep;
+extern struct kmem_cache *prlfs_attr_cachep;
+extern struct kmem_cache *prlfs_file_desc_cachep;
+extern struct kmem_cache *prlfs_dentry_cachep;
+extern struct kmem_cache *prlfs_file_cachep;
+
+static inline void init_pfi(struct prlfs_file_info *pfi, struct prlfs_fd *pfd,
 				unsigned long long offset, unsigned int flags)
 {
-	if(inode) {
-		pfi->fd = inode_get_pfd(inode)->fd;
-		pfi->sfid = inode_get_pfd(inode)->sfid;
+	if(pfd) {
+		pfi->fd = pfd->fd;
+		pfi->sfid = pfd->sfid;
 	} else {
 		pfi->fd = 0;
 		pfi->sfid = 0;
@@ -189,16 +300,35 @@ int host_request_mount(struct super_block *sb,
 				 struct prlfs_sf_parameters *psp);
 int host_request_open(struct super_block *sb, struct prlfs_file_info *pfi,
 						const char *p, int plen);
+int host_request_open_attr(struct super_block *sb, struct prlfs_file_info *pfi,
+			   const char *p, int plen, struct prlfs_attr *attr);
+int host_request_compound(struct super_block *sb, struct prlfs_compound_op *ops,
+			  int nops, struct buffer_descriptor *bd, int nbd,
+			  int *err);
 int host_request_release(struct super_block *sb, struct prlfs_file_info *pfi);
+int host_request_flush(struct super_block *sb, struct prlfs_file_info *pfi);
+int host_request_copy(struct super_block *sb, struct prlfs_file_info *src,
+		      struct prlfs_file_info *dst, struct prlfs_copy_range *cr);
+int host_request_fallocate(struct super_block *sb, struct prlfs_file_info *pfi,
+			   struct prlfs_fallocate *fa);
+int host_request_seek(struct super_block *sb, struct prlfs_file_info *pfi,
+		      struct prlfs_seek *ps);
 int host_request_readdir(struct super_block *sb, struct prlfs_file_info *pfi,
 						 void *buf, int *buflen);
+int host_request_readdirplus(struct super_block *sb,
+			     struct prlfs_file_info *pfi,
+			     void *buf, int *buflen);
 int host_request_rw(struct super_block *sb, struct prlfs_file_info *pfi,
 						 struct buffer_descriptor *bd);
+int host_request_rw_async(struct super_block *sb, struct prlfs_file_info *pfi,
+			  struct buffer_descriptor *bd,
+			  void (*done)(void *data, ssize_t ret), void *data);
 int host_request_remove(struct super_block *sb, void *buf, int buflen);
 int host_request_rename(struct super_block *sb, void *buf, size_t buflen,
 				void *nbuf, size_t nlen);
 int host_request_statfs(struct super_block *sb, long *bsize,
 						compat_statfs_block *blocks, compat_statfs_block *bfree);
+int host_request_notify(struct super_block *sb, void *buf, int *buflen);
 int host_request_readlink(struct super_block *sb, void *src_path, int src_len,
                                                   void *tgt_path, int tgt_len);
 int host_request_symlink(struct super_block *sb, const void *src_path, int src_len,
@@ -233,6 +363,20 @@ int host_request_symlink(struct super_block *sb, const void *src_path, int src_l
 
 #define PRLFS_ROOT_INO 2
 #define PRLFS_GOOD_INO 8
+/* max number of page cache pages transferred by a single host request */
+#define PRLFS_RW_PAGES_MAX 256
+/* readdir buffer size limits, see the "rdsize=" mount option */
+#define PRLFS_RDSIZE_DEFAULT (64 * 1024)
+#define PRLFS_RDSIZE_MAX (1024 * 1024)
+/* default attribute cache lifetime bounds for files and directories */
+#define PRLFS_ATTR_MIN_DEFAULT HZ
+#define PRLFS_ATTR_MAX_DEFAULT (30 * HZ)
+/* dentry ttl while the host notifies us about changes */
+#define PRLFS_NOTIFY_TTL (300 * HZ)
+#define PRLFS_NOTIFY_BUFSIZE (16 * 1024)
+/* how long and for how many inodes closed host handles are kept open */
+#define PRLFS_IDLE_TTL (5 * HZ)
+#define PRLFS_IDLE_MAX 256
 #define ID_STR_LEN 16
 
 #ifndef PCI_VENDOR_ID_PARALLELS
@@ -242,11 +386,49 @@ int host_request_symlink(struct super_block *sb, const void *src_path, int src_l
 #define PCI_DEVICE_ID_TOOLGATE		0x4000
 #endif
 
-/* Dentry prlfs speciffic flags stored in dentry->d_fsdata */
+/* Dentry prlfs speciffic flags stored in prlfs_dentry_info */
 enum {
 	PRL_DFL_TAG = 0x1UL, /* tagged detnry, used for debuging purposes */
 	PRL_DFL_UNLINKED = 0x2UL, /* Unlinked dentry. */
 };
 
+/* Host path of a dentry, never changed once built */
+struct prlfs_path {
+	atomic_t count;
+	struct prlfs_path *parent;	/* path of the parent it was built on */
+	int len;		/* including the trailing '\0' */
+	char buf[0];
+};
+
+/* dentry->d_fsdata */
+struct prlfs_dentry_info {
+	unsigned long flags;
+	struct prlfs_path *path;	/* cached host path, under d_lock */
+};
+
 unsigned long *prlfs_dfl( struct dentry *de);
+struct prlfs_dentry_info *prlfs_dentry_info_alloc(void);
+void prlfs_dentry_info_free(struct prlfs_dentry_info *di);
+struct prlfs_path *prlfs_path_get(struct dentry *dentry);
+int prlfs_i_update(struct dentry *dentry, struct prlfs_attr *attr);
+void prlfs_link_drop(struct inode *inode);
+ino_t prlfs_dentry_prime(struct dentry *parent, const char *name, int len,
+			 struct prlfs_attr *attr);
+void prlfs_path_put(struct prlfs_path *path);
+void prlfs_notify_start(struct super_block *sb);
+void prlfs_notify_stop(struct super_block *sb);
+struct prlfs_fd *prlfs_fd_get(struct inode *inode, struct file *filp,
+			      int write);
+void prlfs_fd_put(struct inode *inode, struct file *filp,
+		  struct prlfs_fd *pfd);
+void prlfs_fd_close(struct inode *inode, struct prlfs_fd *pfd);
+void prlfs_fd_stat(int hit);
+void prlfs_i_size_extend(struct inode *inode, loff_t pos);
+int prlfs_idle_add(struct inode *inode, struct prlfs_fd *pfd);
+void prlfs_idle_close(struct inode *inode);
+void prlfs_idle_close_sb(struct super_block *sb);
+int prlfs_idle_init(void);
+void prlfs_idle_exit(void);
+struct seq_file;
+int prlfs_idle_stats_show(struct seq_file *m, void *v);
 #endif /* __PRL_FS_H__ */
@@ -64,7 +64,10 @@ prlfs_parse_mount_options(char *options, struct prlfs_sb_info *sbi)
 	DPRINTK("ENTER\n");
 	sbi->uid = current->cred->uid;
 	sbi->gid = current->cred->gid;
-	sbi->ttl = HZ;
+	sbi->attr_min = sbi->dir_min = PRLFS_ATTR_MIN_DEFAULT;
+	sbi->attr_max = sbi->dir_max = PRLFS_ATTR_MAX_DEFAULT;
+	sbi->neg_ttl = HZ;
+	sbi->rdsize = PRLFS_RDSIZE_DEFAULT;
 
 	if (!options)
 	       goto out;
@@ -80,8 +83,22 @@ prlfs_parse_mount_options(char *options, struct prlfs_sb_info *sbi)
 			if (strlen(val) == 0)
 				val = NULL;
 		}
-		if (!strcmp(opt, "ttl") && val)
-			ret = prlfs_strtoui(val, &sbi->ttl);
+		if (!strcmp(opt, "ttl") && val) {
+			/* fixed lifetime, as before the adaptive one */
+			ret = prlfs_strtoui(val, &sbi->attr_min);
+			sbi->attr_max = sbi->dir_min = sbi->dir_max =
+				sbi->attr_min;
+		}
+		else if (!strcmp(opt, "attr_min") && val)
+			ret = prlfs_strtoui(val, &sbi->attr_min);
+		else if (!strcmp(opt, "attr_max") && val)
+			ret = prlfs_strtoui(val, &sbi->attr_max);
+		else if (!strcmp(opt, "dir_min") && val)
+			ret = prlfs_strtoui(val, &sbi->dir_min);
+		else if (!strcmp(opt, "dir_max") && val)
+			ret = prlfs_strtoui(val, &sbi->dir_max);
+		else if (!strcmp(opt, "neg_ttl") && val)
+			ret = prlfs_strtoui(val, &sbi->neg_ttl);
 		else if (!strcmp(opt, "uid") && val) {
 			uid_t uid_arg = -1;
 			ret = prlfs_strtoui(val, &uid_arg);
@@ -100,11 +117,30 @@ prlfs_parse_mount_options(char *options, struct prlfs_sb_info *sbi)
 			sbi->plain = 1;
 		else if (!strcmp(opt, "host_inodes"))
 			sbi->host_inodes = 1;
+		else if (!strcmp(opt, "cache") && val) {
+			if (!strcmp(val, "none"))
+				sbi->cache = PRLFS_CACHE_NONE;
+			else if (!strcmp(val, "buffered"))
+				sbi->cache = PRLFS_CACHE_BUFFERED;
+			else if (!strcmp(val, "writeback"))
+				sbi->cache = PRLFS_CACHE_WRITEBACK;
+			else
+				ret = -EINVAL;
+		}
+		else if (!strcmp(opt, "rdsize") && val) {
+			ret = prlfs_strtoui(val, &sbi->rdsize);
+			sbi->rdsize = clamp_t(unsigned, PAGE_ALIGN(sbi->rdsize),
+					      PAGE_SIZE, PRLFS_RDSIZE_MAX);
+		}
 		else if (!strcmp(opt, "sf") && val)
 			strncpy(sbi->name, val, sizeof(sbi->name));
 		else
 			ret = -EINVAL;
 	}
+	if (sbi->attr_max < sbi->attr_min)
+		sbi->attr_max = sbi->attr_min;
+	if (sbi->dir_max < sbi->dir_min)
+		sbi->dir_max = sbi->dir_min;
 out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
@@ -118,7 +154,9 @@ static int prlfs_remount(struct super_block *sb, int *flags, char *data)
 	       ((*flags) & MS_MANDLOCK) )
 			ret = -EINVAL;
 
-	*flags |= MS_SYNCHRONOUS; /* silently don't drop sync flag */
+	/* silently don't drop sync flag, unless cache=writeback asked to */
+	if (PRLFS_SB(sb)->cache != PRLFS_CACHE_WRITEBACK)
+		*flags |= MS_SYNCHRONOUS;
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
 }
@@ -129,6 +167,7 @@ static void prlfs_put_super(struct super_block *sb)
 
 	prlfs_sb = PRLFS_SB(sb);
 	prlfs_bdi_destroy(&prlfs_sb->bdi);
+	prlfs_dentry_info_free(prlfs_sb->root_info);
 	kfree(prlfs_sb);
 }
 
@@ -163,6 +202,8 @@ int prlfs_statfs(struct dentry *de, struct kstatfs *buf)
 }
 
 static void prlfs_evict_inode(struct inode *inode) {
+	prlfs_idle_close(inode);
+	prlfs_link_drop(inode);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
 	truncate_inode_pages_final(&inode->i_data);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36) && LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
@@ -180,8 +221,115 @@ static void prlfs_evict_inode(struct inode *inode) {
 #else
 	clear_inode(inode);
 #endif
-	kfree(inode_get_pfd(inode));
-	inode_set_pfd(inode, NULL);
+}
+
+struct kmem_cache *prlfs_inode_cachep;
+struct kmem_cache *prlfs_attr_cachep;
+struct kmem_cache *prlfs_file_desc_cachep;
+struct kmem_cache *prlfs_dentry_cachep;
+struct kmem_cache *prlfs_file_cachep;
+
+static struct inode *prlfs_alloc_inode(struct super_block *sb)
+{
+	struct prlfs_inode_info *pi;
+
+	pi = kmem_cache_alloc(prlfs_inode_cachep, GFP_KERNEL);
+	if (pi == NULL)
+		return NULL;
+	memset(pi->pfd, 0, sizeof(pi->pfd));
+	pi->host_ino = 0;
+	pi->attr_timeo = 0;
+	pi->cto_valid = 0;
+	pi->cto_written = 0;
+	atomic_set(&pi->wr_pending, 0);
+	pi->link = NULL;
+	return &pi->vfs_inode;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+static void prlfs_free_inode(struct inode *inode)
+{
+	kmem_cache_free(prlfs_inode_cachep, PRLFS_I(inode));
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+static void prlfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(prlfs_inode_cachep, PRLFS_I(inode));
+}
+
+static void prlfs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, prlfs_i_callback);
+}
+#else
+static void prlfs_destroy_inode(struct inode *inode)
+{
+	kmem_cache_free(prlfs_inode_cachep, PRLFS_I(inode));
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+static void prlfs_inode_init_once(void *foo)
+#else
+static void prlfs_inode_init_once(void *foo, struct kmem_cache *cachep,
+				  unsigned long flags)
+#endif
+{
+	struct prlfs_inode_info *pi = foo;
+
+	mutex_init(&pi->open_lock);
+	spin_lock_init(&pi->fd_lock);
+	init_waitqueue_head(&pi->fd_wait);
+	spin_lock_init(&pi->wr_lock);
+	INIT_LIST_HEAD(&pi->wr_ranges);
+	init_waitqueue_head(&pi->wr_wait);
+	INIT_LIST_HEAD(&pi->idle_lru);
+	inode_init_once(&pi->vfs_inode);
+}
+
+static void prlfs_destroy_caches(void);
+
+static int prlfs_init_caches(void)
+{
+	prlfs_inode_cachep = kmem_cache_create("prlfs_inode_cache",
+				sizeof(struct prlfs_inode_info), 0,
+				SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+				prlfs_inode_init_once);
+	prlfs_attr_cachep = kmem_cache_create("prlfs_attr",
+				sizeof(struct prlfs_attr), 0, 0, NULL);
+	prlfs_file_desc_cachep = kmem_cache_create("prlfs_file_desc",
+				sizeof(struct prlfs_file_desc), 0, 0, NULL);
+	prlfs_dentry_cachep = kmem_cache_create("prlfs_dentry_info",
+				sizeof(struct prlfs_dentry_info), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	prlfs_file_cachep = kmem_cache_create("prlfs_file",
+				sizeof(struct prlfs_file), 0, 0, NULL);
+	if (prlfs_inode_cachep && prlfs_attr_cachep &&
+	    prlfs_file_desc_cachep && prlfs_dentry_cachep &&
+	    prlfs_file_cachep)
+		return 0;
+	prlfs_destroy_caches();
+	return -ENOMEM;
+}
+
+static void prlfs_destroy_caches(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+	/* inodes are freed after an RCU grace period */
+	rcu_barrier();
+#endif
+	if (prlfs_file_cachep)
+		kmem_cache_destroy(prlfs_file_cachep);
+	if (prlfs_dentry_cachep)
+		kmem_cache_destroy(prlfs_dentry_cachep);
+	if (prlfs_file_desc_cachep)
+		kmem_cache_destroy(prlfs_file_desc_cachep);
+	if (prlfs_attr_cachep)
+		kmem_cache_destroy(prlfs_attr_cachep);
+	if (prlfs_inode_cachep)
+		kmem_cache_destroy(prlfs_inode_cachep);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
@@ -193,10 +341,25 @@ int prlfs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
 #endif
 	struct prlfs_sb_info *prlfs_sb = PRLFS_SB(sb);
 
-	seq_printf(seq, ",ttl=%u", prlfs_sb->ttl);
+	if (prlfs_sb->attr_min != PRLFS_ATTR_MIN_DEFAULT)
+		seq_printf(seq, ",attr_min=%u", prlfs_sb->attr_min);
+	if (prlfs_sb->attr_max != PRLFS_ATTR_MAX_DEFAULT)
+		seq_printf(seq, ",attr_max=%u", prlfs_sb->attr_max);
+	if (prlfs_sb->dir_min != PRLFS_ATTR_MIN_DEFAULT)
+		seq_printf(seq, ",dir_min=%u", prlfs_sb->dir_min);
+	if (prlfs_sb->dir_max != PRLFS_ATTR_MAX_DEFAULT)
+		seq_printf(seq, ",dir_max=%u", prlfs_sb->dir_max);
+	if (prlfs_sb->neg_ttl != HZ)
+		seq_printf(seq, ",neg_ttl=%u", prlfs_sb->neg_ttl);
 
 	if (prlfs_sb->nls[0])
 		seq_printf(seq, ",nls=%s", prlfs_sb->nls);
+	if (prlfs_sb->cache == PRLFS_CACHE_NONE)
+		seq_puts(seq, ",cache=none");
+	else if (prlfs_sb->cache == PRLFS_CACHE_WRITEBACK)
+		seq_puts(seq, ",cache=writeback");
+	if (prlfs_sb->rdsize != PRLFS_RDSIZE_DEFAULT)
+		seq_printf(seq, ",rdsize=%u", prlfs_sb->rdsize);
 	if (prlfs_sb->share)
 		seq_puts(seq, ",share");
 	else if (prlfs_sb->plain)
@@ -212,6 +375,12 @@ int prlfs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
 struct super_operations prlfs_super_ops = {
 #ifndef PRLFS_IGET
 	.read_inode	= prlfs_read_inode,
+#endif
+	.alloc_inode	= prlfs_alloc_inode,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	.free_inode	= prlfs_free_inode,
+#else
+	.destroy_inode	= prlfs_destroy_inode,
 #endif
 	.statfs         = prlfs_statfs,
 	.remount_fs	= prlfs_remount,
@@ -325,13 +494,14 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct inode * inode;
 	struct prlfs_sb_info *prlfs_sb;
+	struct prlfs_sf_features sff;
 	int ret = 0;
 
 	DPRINTK("ENTER\n");
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_blocksize = PAGE_SIZE;
 	sb->s_blocksize_bits = PAGE_SHIFT;
-	sb->s_flags |= MS_NOATIME | MS_SYNCHRONOUS;
+	sb->s_flags |= MS_NOATIME;
 	sb->s_magic = PRLFS_MAGIC;
 	sb->s_op = &prlfs_super_ops;
 
@@ -346,12 +516,36 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 	ret = prlfs_parse_mount_options(data, prlfs_sb);
 	if (ret < 0)
 		goto out_free;
-
-	if (prlfs_sb->host_inodes) {
-		struct prlfs_sf_features sff = {PRLFS_SFF_HOST_INODES};
-		if ((get_sf_features(tg_dev, &sff) < 0) || !(sff.flags & PRLFS_SFF_HOST_INODES))
-			prlfs_sb->host_inodes = 0;
+	/*
+	 * MS_SYNCHRONOUS makes every write(2) an fsync and a host flush,
+	 * cache=writeback leaves that to fsync(2), O_SYNC and O_DSYNC.
+	 */
+	if (prlfs_sb->cache != PRLFS_CACHE_WRITEBACK)
+		sb->s_flags |= MS_SYNCHRONOUS;
+	prlfs_sb->root_info = prlfs_dentry_info_alloc();
+	if (prlfs_sb->root_info == NULL) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
+
+	/* ask for everything we can use, the host clears what it lacks */
+	sff.flags = PRLFS_SFF_READDIRPLUS | PRLFS_SFF_NOTIFY | PRLFS_SFF_COMPOUND |
+		    PRLFS_SFF_FLUSH | PRLFS_SFF_COPY | PRLFS_SFF_FALLOCATE |
+		    PRLFS_SFF_SEEK;
+	if (prlfs_sb->host_inodes)
+		sff.flags |= PRLFS_SFF_HOST_INODES | PRLFS_SFF_DIRENT_INO;
+	get_sf_features(tg_dev, &sff);
+	if (!(sff.flags & PRLFS_SFF_HOST_INODES))
+		prlfs_sb->host_inodes = 0;
+	prlfs_sb->dirent_ino = prlfs_sb->host_inodes &&
+			       (sff.flags & PRLFS_SFF_DIRENT_INO);
+	atomic_set(&prlfs_sb->dirent_next_ino, PRLFS_GOOD_INO);
+	prlfs_sb->readdirplus = !!(sff.flags & PRLFS_SFF_READDIRPLUS);
+	prlfs_sb->compound = !!(sff.flags & PRLFS_SFF_COMPOUND);
+	prlfs_sb->flush = !!(sff.flags & PRLFS_SFF_FLUSH);
+	prlfs_sb->copy = !!(sff.flags & PRLFS_SFF_COPY);
+	prlfs_sb->fallocate = !!(sff.flags & PRLFS_SFF_FALLOCATE);
+	prlfs_sb->seek = !!(sff.flags & PRLFS_SFF_SEEK);
 	ret = get_sf_id(tg_dev, prlfs_sb->name);
 	if (ret < 0)
 		goto out_free;
@@ -359,6 +553,10 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 	ret = prlfs_bdi_init_and_register(sb, prlfs_sb);
 	if (ret)
 		goto out_bdi;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+	/* let readahead fill a whole host request */
+	sb->s_bdi->ra_pages = PRLFS_RW_PAGES_MAX;
+#endif
 
 	DPRINTK("share=%s id=%u\n", prlfs_sb->name, prlfs_sb->sfid);
 
@@ -376,6 +574,10 @@ static int prlfs_fill_super(struct super_block *sb, void *data, int silent)
 		ret = -ENOMEM;
 		goto out_iput;
 	}
+	/* freed by prlfs_put_super(), the root has no d_release */
+	sb->s_root->d_fsdata = prlfs_sb->root_info;
+	if (sff.flags & PRLFS_SFF_NOTIFY)
+		prlfs_notify_start(sb);
 out:
 	DPRINTK("EXIT returning %d\n", ret);
 	return ret;
@@ -385,7 +587,9 @@ out_iput:
 out_bdi:
 	prlfs_bdi_destroy(&prlfs_sb->bdi);
 out_free:
+	prlfs_dentry_info_free(prlfs_sb->root_info);
 	kfree(prlfs_sb);
+	sb->s_fs_info = NULL;
 	goto out;
 }
 
@@ -445,6 +649,15 @@ static struct dentry *prlfs_mount(struct file_system_type *fs_type,
 }
 #endif
 
+static void prlfs_kill_sb(struct super_block *sb)
+{
+	/* the listener walks the dcache, stop it before it goes away */
+	prlfs_notify_stop(sb);
+	/* drop the inode references held by the idle handle pruner */
+	prlfs_idle_close_sb(sb);
+	kill_anon_super(sb);
+}
+
 static struct file_system_type prl_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "prl_fs",
@@ -453,8 +666,9 @@ static struct file_system_type prl_fs_type = {
 #else
 	.mount		= prlfs_mount,
 #endif
-	.kill_sb	= kill_anon_super,
-	/*  .fs_flags */
+	.kill_sb	= prlfs_kill_sb,
+	/* prlfs_rename() moves dentries itself to keep cached paths valid */
+	.fs_flags	= FS_RENAME_DOES_D_MOVE,
 };
 
 #ifdef CONFIG_PROC_FS
@@ -572,6 +786,18 @@ static struct proc_ops proc_sf_operations = PRLFS_PROC_OPS_INIT(
 		seq_lseek,
 		seq_release);
 
+static int proc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, prlfs_idle_stats_show, NULL);
+}
+
+static struct proc_ops proc_stats_operations = PRLFS_PROC_OPS_INIT(
+		THIS_MODULE,
+		proc_stats_open,
+		seq_read,
+		seq_lseek,
+		single_release);
+
 static int prlfs_proc_init(void)
 {
 	int ret = 0;
@@ -590,12 +816,22 @@ static int prlfs_proc_init(void)
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	p = prlfs_proc_create("stats", S_IFREG | S_IRUGO, proc_prlfs,
+		&proc_stats_operations);
+	if (p == NULL) {
+		remove_proc_entry("sf_list", proc_prlfs);
+		remove_proc_entry("fs/prl_fs", NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
 out:
 	return ret;
 }
 
 static void prlfs_proc_clean(void)
 {
+	remove_proc_entry("stats", proc_prlfs);
 	remove_proc_entry("sf_list", proc_prlfs);
 	remove_proc_entry("fs/prl_fs", NULL);
 }
@@ -622,9 +858,15 @@ static int __init init_prlfs(void)
 		goto out;
 	}
 	pci_dev_get(tg_dev);
-	ret = prlfs_proc_init();
+	ret = prlfs_init_caches();
 	if (ret < 0)
 		goto out_dev_put;
+	ret = prlfs_idle_init();
+	if (ret < 0)
+		goto out_caches;
+	ret = prlfs_proc_init();
+	if (ret < 0)
+		goto out_idle;
 
 	ret = register_filesystem(&prl_fs_type);
 	if (ret < 0)
@@ -632,6 +874,10 @@ static int __init init_prlfs(void)
 	else
 		goto out;
 
+out_idle:
+	prlfs_idle_exit();
+out_caches:
+	prlfs_destroy_caches();
 out_dev_put:
 	pci_dev_put(tg_dev);
 out:
@@ -645,6 +891,8 @@ static void __exit exit_prlfs(void)
 	printk(KERN_INFO "unloading " MODNAME "\n");
 	unregister_filesystem(&prl_fs_type);
 	prlfs_proc_clean();
+	prlfs_idle_exit();
+	prlfs_destroy_caches();
 	pci_dev_put(tg_dev);
 	DPRINTK("EXIT\n");
 }
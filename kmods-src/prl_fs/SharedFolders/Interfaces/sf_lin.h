@@ -76,6 +76,30 @@ typedef struct prlfs_dir_entry prlfs_dirent;
 #define PRLFS_DIR_REC_LEN(name_len)	(((name_len) + sizeof(prlfs_dirent) + PRLFS_DIR_ROUND ) & \
 					 ~PRLFS_DIR_ROUND)
 
+/* TG_REQUEST_FS_L_READDIRPLUS entry: attributes come along with the name */
+struct prlfs_dir_entry_plus {
+	struct prlfs_attr attr;
+	unsigned char	name_len;
+	unsigned char	file_type;
+	char	name[1];
+} PACKED;
+typedef struct prlfs_dir_entry_plus prlfs_dirent_plus;
+
+#define PRLFS_DIRPLUS_REC_LEN(name_len)	(((name_len) + sizeof(prlfs_dirent_plus) + PRLFS_DIR_ROUND ) & \
+					 ~PRLFS_DIR_ROUND)
+
+/* TG_REQUEST_FS_L_READDIR entry when PRLFS_SFF_DIRENT_INO is requested */
+struct prlfs_dir_entry_ino {
+	unsigned long long ino;
+	unsigned char	name_len;
+	unsigned char	file_type;
+	char	name[1];
+} PACKED;
+typedef struct prlfs_dir_entry_ino prlfs_dirent_ino;
+
+#define PRLFS_DIRINO_REC_LEN(name_len)	(((name_len) + sizeof(prlfs_dirent_ino) + PRLFS_DIR_ROUND ) & \
+					 ~PRLFS_DIR_ROUND)
+
 enum {
 	PRLFS_FILE_TYPE_UNKNOWN = 0,
 	PRLFS_FILE_TYPE_REGULAR,
@@ -84,6 +108,101 @@ enum {
 	PRLFS_FILE_TYPE_MAX,
 };
 
+/*
+ * TG_REQUEST_FS_L_NOTIFY event. The request stays pending on the host
+ * until something changes in the shared folder, then returns a batch of
+ * these records. The path is relative to the shared folder root.
+ */
+struct prlfs_notify_event {
+	unsigned int	action;
+	unsigned short	path_len;
+	char	path[1];
+} PACKED;
+
+#define PRLFS_NOTIFY_REC_LEN(path_len)	(((path_len) + sizeof(struct prlfs_notify_event) + \
+					 PRLFS_DIR_ROUND ) & ~PRLFS_DIR_ROUND)
+
+enum {
+	PRLFS_NOTIFY_ADDED = 1,
+	PRLFS_NOTIFY_REMOVED,
+	PRLFS_NOTIFY_MODIFIED,
+	PRLFS_NOTIFY_RENAMED_OLD,
+	PRLFS_NOTIFY_RENAMED_NEW,
+	/* host dropped events, everything cached may be stale */
+	PRLFS_NOTIFY_OVERFLOW = 0x100,
+};
+
+/*
+ * TG_REQUEST_FS_L_COMPOUND: several FS_L operations in one request. Buffer 0
+ * is the table of the operations, the buffers they use follow it. The host
+ * runs the operations in order and stops at the first one that fails; the
+ * ones it did not run keep TG_STATUS_PENDING. The request itself fails only
+ * if it is malformed.
+ */
+struct prlfs_compound_op {
+	unsigned int	op;	/* TG_REQUEST_FS_L_OPEN or TG_REQUEST_FS_L_ATTR */
+	unsigned int	status;	/* TG_STATUS_* of the operation, set by the host */
+	unsigned int	flags;	/* PRLFS_SFF_* the operation runs with */
+	unsigned short	path;	/* request buffer with the path */
+	unsigned short	data;	/* buffer with the prlfs_file_desc or prlfs_attr */
+} PACKED;
+SFLIN_CHECK_SIZE(prlfs_compound_op, sizeof(struct prlfs_compound_op), 16)
+
+#define PRLFS_COMPOUND_MAX_OPS	4
+
+/*
+ * TG_REQUEST_FS_L_COPY: the host copies len bytes from the offset of the
+ * first file descriptor to the offset of the second one, and returns the
+ * number of bytes copied in len. With PRLFS_COPY_CLONE the files share the
+ * blocks instead, and the request fails if the host filesystem can not.
+ */
+struct prlfs_copy_range {
+	unsigned long long len;
+	unsigned int	flags;
+	unsigned int	reserved;
+} PACKED;
+SFLIN_CHECK_SIZE(prlfs_copy_range, sizeof(struct prlfs_copy_range), 16)
+
+enum {
+	PRLFS_COPY_CLONE = 1,
+};
+
+/*
+ * TG_REQUEST_FS_L_FALLOCATE: allocates, punches or zeroes len bytes of the
+ * file from the offset of its file descriptor.
+ */
+struct prlfs_fallocate {
+	unsigned long long len;
+	unsigned int	mode;	/* PRLFS_FALLOC_* */
+	unsigned int	reserved;
+} PACKED;
+SFLIN_CHECK_SIZE(prlfs_fallocate, sizeof(struct prlfs_fallocate), 16)
+
+enum {
+	PRLFS_FALLOC_KEEP_SIZE = 1,
+	PRLFS_FALLOC_PUNCH_HOLE = 2,
+	PRLFS_FALLOC_ZERO_RANGE = 4,
+};
+
+/*
+ * TG_REQUEST_FS_L_SEEK: the host looks for the next data or hole at or
+ * after offset and returns where it starts in offset, PRLFS_SEEK_NONE if
+ * there is none before the end of the file.
+ */
+struct prlfs_seek {
+	unsigned long long offset;
+	unsigned int	whence;	/* PRLFS_SEEK_DATA or PRLFS_SEEK_HOLE */
+	unsigned int	reserved;
+} PACKED;
+SFLIN_CHECK_SIZE(prlfs_seek, sizeof(struct prlfs_seek), 16)
+
+enum {
+	PRLFS_SEEK_DATA = 3,
+	PRLFS_SEEK_HOLE = 4,
+};
+
+#define PRLFS_SEEK_NONE	(~0ULL)
+
 /* ToolGate data structure, OS independed data representation*/
 struct prlfs_file_desc {
         unsigned long long      fd;
@@ -401,6 +520,14 @@ struct prlfs_sf_response {
 
 enum {
 	PRLFS_SFF_HOST_INODES = 1,
+	PRLFS_SFF_READDIRPLUS = 2,
+	PRLFS_SFF_NOTIFY = 4,
+	PRLFS_SFF_DIRENT_INO = 8,
+	PRLFS_SFF_COMPOUND = 16,
+	PRLFS_SFF_FLUSH = 32,
+	PRLFS_SFF_COPY = 64,
+	PRLFS_SFF_FALLOCATE = 128,
+	PRLFS_SFF_SEEK = 256,
 };
 
 struct prlfs_sf_features {
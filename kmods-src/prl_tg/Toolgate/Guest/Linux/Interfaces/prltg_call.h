@@ -9,3 +9,5 @@ extern int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc);
 extern struct TG_PENDING_REQUEST *call_tg_async_start(struct tg_dev *dev, TG_REQ_DESC *sdesc);
 extern void call_tg_async_wait(struct TG_PENDING_REQUEST *req);
 extern void call_tg_async_cancel(struct TG_PENDING_REQUEST *req);
+extern int call_tg_async_start_cb(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+				  void (*done)(void *data), void *data);
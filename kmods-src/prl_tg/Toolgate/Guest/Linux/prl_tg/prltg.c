@@ -76,7 +76,7 @@ static void tg_do_work(struct work_struct *work)
 
 	list_for_each_safe(tmp, n, &completed) {
 		req = list_entry(tmp, struct TG_PENDING_REQUEST, pr_list);
-		complete(&req->waiting);
+		tg_req_finish(req);
 	}
 
 	DPRINTK("EXIT\n");
@@ -116,7 +116,7 @@ static void tg_req_cancel_all(struct tg_dev *dev)
 			msleep(timeout);
 			timeout *= 2;
 		}
-		if (req->dst->Status == TG_STATUS_PENDING)
+		if (req->dst->Status == TG_STATUS_PENDING) {
 			/* Host don't cancel request. If we free it we can get
 			 * the memory corruption if host will handle it later.
 			 * If we don't free it, we'll leak the memory if host
@@ -124,8 +124,9 @@ static void tg_req_cancel_all(struct tg_dev *dev)
 			 * better than memory corruption */
 			 printk(KERN_ERR PFX "Host don't handle "
 					"request's cancel %p\n", req);
-		else
-		complete(&req->waiting);
+			 tg_req_abandon(req);
+		} else
+			tg_req_finish(req);
 	}
 	DPRINTK("EXIT\n");
 }
@@ -507,6 +508,8 @@ void prl_tg_remove_common(struct tg_dev *dev)
 		remove_proc_entry(proc_file, NULL);
 	}
 
+	/* nobody completes the requests left after this */
+	tg_req_cancel_all(dev);
 	prl_tg_deinitialize(dev);
 	kfree(dev);
 }
@@ -308,6 +308,8 @@ static struct TG_PENDING_REQUEST *tg_req_create(struct tg_dev *dev, TG_REQ_DESC
 	req->dev = dev;
 	req->sdesc = sdesc;
 	req->dst = dst;
+	req->done = NULL;
+	req->done_data = NULL;
 	INIT_LIST_HEAD(&req->pr_list);
 	INIT_LIST_HEAD(&req->up_list);
 
@@ -492,6 +494,49 @@ static void tg_req_destroy(struct TG_PENDING_REQUEST *req)
 	return;
 }
 
+static void tg_req_release(struct TG_PENDING_REQUEST *req)
+{
+	void (*done)(void *data) = req->done;
+	void *data = req->done_data;
+
+	tg_req_destroy(req);
+	done(data);
+}
+
+/*
+ * Called from the interrupt's bottom half and from tg_req_cancel_all()
+ * once the host is done with the request. Nobody waits for requests
+ * started by call_tg_async_start_cb(), they are released right here.
+ */
+void tg_req_finish(struct TG_PENDING_REQUEST *req)
+{
+	struct tg_dev *dev = req->dev;
+
+	if (req->done == NULL) {
+		complete(&req->waiting);
+		return;
+	}
+
+	page_cache_release(req->pg);
+	pci_unmap_page(dev->pci_dev, req->phys, PAGE_SIZE, PCI_DMA_BIDIRECTIONAL);
+	tg_req_release(req);
+}
+
+/*
+ * The host did not confirm the cancel of req, it may still write to the
+ * request and its pages: they stay allocated and pinned for good. The
+ * caller of call_tg_async_start_cb() is told the request was cancelled,
+ * it would wait for it forever otherwise.
+ */
+void tg_req_abandon(struct TG_PENDING_REQUEST *req)
+{
+	if (req->done == NULL)
+		return;
+
+	req->sdesc->src->Status = TG_STATUS_CANCELLED;
+	req->done(req->done_data);
+}
+
 int call_tg_sync(struct tg_dev *dev, TG_REQ_DESC *sdesc)
 {
 	struct TG_PENDING_REQUEST *req;
@@ -541,3 +586,29 @@ void call_tg_async_cancel(struct TG_PENDING_REQUEST *req)
 	}
 }
 EXPORT_SYMBOL(call_tg_async_cancel);
+
+/*
+ * Submit the request without waiting for it. @done is called with @data
+ * when the request is finished: from the toolgate work queue, right
+ * away if the host completed the request on submission, or with
+ * TG_STATUS_CANCELLED on suspend and device removal. Status and
+ * buffer byte counts are already copied back to sdesc at that point,
+ * and sdesc with all its buffers must stay alive until then.
+ */
+int call_tg_async_start_cb(struct tg_dev *dev, TG_REQ_DESC *sdesc,
+			   void (*done)(void *data), void *data)
+{
+	struct TG_PENDING_REQUEST *req;
+
+	req = tg_req_create(dev, sdesc);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->done = done;
+	req->done_data = data;
+	/* req may be already released by the work queue once it is pending */
+	if (tg_req_submit(req) != TG_STATUS_PENDING)
+		tg_req_release(req);
+	return 0;
+}
+EXPORT_SYMBOL(call_tg_async_start_cb);
@@ -98,6 +98,9 @@ struct TG_PENDING_REQUEST
 	struct list_head up_list;
 
 	struct completion waiting;
+	/* completion callback of call_tg_async_start_cb() requests */
+	void (*done)(void *data);
+	void *done_data;
 	int processed;				/* Protected by queue_lock */
 	dma_addr_t phys;			/* Physical address of first page of request */
 	struct page *pg;			/* First page of request descriptor */
@@ -199,6 +202,9 @@ int prl_tg_suspend_common(struct tg_dev *dev, pm_message_t state);
 int prl_tg_resume_common(struct tg_dev *dev);
 #endif
 
+void tg_req_finish(struct TG_PENDING_REQUEST *req);
+void tg_req_abandon(struct TG_PENDING_REQUEST *req);
+
 int prl_tg_user_to_host_request_prepare(void *ureq, TG_REQ_DESC *sdesc, TG_REQUEST *src);
 int prl_tg_user_to_host_request_complete(char *u, TG_REQ_DESC *sdesc, int ret);
 #endif
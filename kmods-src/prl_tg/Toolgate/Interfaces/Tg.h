@@ -128,6 +128,12 @@ typedef struct _TG_PAGED_REQUEST {
 
 #define TG_REQUEST_FS_L_READLNK 0x22c
 #define TG_REQUEST_FS_L_CREATELNK 0x22d
+#define TG_REQUEST_FS_L_READDIRPLUS 0x22e
+#define TG_REQUEST_FS_L_NOTIFY 0x22f
+#define TG_REQUEST_FS_L_COMPOUND 0x230
+#define TG_REQUEST_FS_L_COPY 0x231
+#define TG_REQUEST_FS_L_FALLOCATE 0x232
+#define TG_REQUEST_FS_L_SEEK 0x233
 
 #define TG_REQUEST_FS_CONTROL 0x23d	// version 4 request
 #define TG_REQUEST_FS_GETVERSION 0x23e